@@ -1,96 +1,788 @@
+#define _GNU_SOURCE // syscall, sched_getcpu, cpu affinity
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CACHE_LINE 64
+// how often a waiter polls the generation before parking in the kernel,
+// only used when every thread of the barrier can have a core of its own
+#define BARRIER_SPIN_LIMIT 4096
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
 
-#define N 10
+static void futex_wait(atomic_uint *addr, unsigned int expected)
+{
+    syscall(SYS_futex, (unsigned int *)addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
 
+static void futex_wake_all(atomic_uint *addr)
+{
+    syscall(SYS_futex, (unsigned int *)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Which arrival scheme a barrier uses. Both release waiters the same way.
+enum barrier_kind
+{
+    // one shared arrival counter, cheapest for a handful of threads
+    BARRIER_CENTRAL,
+    // combining tree with small fan-in, leaves grouped by shared cache
+    BARRIER_TREE,
+};
+
+// fan-in of every combining tree node
+#define BARRIER_TREE_FANOUT 4
+
+struct barrier_node
+{
+    alignas(CACHE_LINE) atomic_int count;
+    int expected;
+    // -1 for the root
+    int parent;
+};
+
+struct barrier_slot
+{
+    int cpu;
+    int leaf;
+};
+
+// Returned by barrier_arrive, identifies the episode the caller arrived in.
+typedef unsigned int barrier_token;
+
+// Generation counted barrier. Every episode bumps the generation, so its lowest
+// bit is the sense that flips between consecutive episodes. A waiter remembers
+// the generation it arrived in and leaves as soon as it changes, which means a
+// fast thread re-entering the next episode can never be mistaken for a late one.
+//
+// A BARRIER_TREE barrier runs its first episode through the central counter and
+// registers every thread with the cpu it arrived on. The last arriver then lays
+// the threads out over the leaves so that threads sharing a cache share a leaf.
+// Every later episode only touches the thread's leaf and, for the last arriver
+// of a node, its parent.
 struct barrier_t
+{
+    alignas(CACHE_LINE) atomic_uint generation;
+    atomic_int sleepers;
+    // arrivals get their own line so they do not bounce the line waiters poll
+    alignas(CACHE_LINE) atomic_int count;
+    int max;
+    int spin_limit;
+    enum barrier_kind kind;
+    // run once per episode by the last arriver, before anybody is released
+    void (*completion)(void *);
+    void *completion_arg;
+
+    struct barrier_node *nodes;
+    int num_leaves;
+    struct barrier_slot *slots;
+    atomic_int registered;
+    pthread_key_t slot_key;
+};
+
+// cpu -> position when all cpus are ordered by package, last level cache and core
+static int *cpu_rank;
+static int num_cpu_rank;
+static pthread_once_t cpu_rank_once = PTHREAD_ONCE_INIT;
+
+struct cpu_topology
+{
+    int package;
+    int cache;
+    int core;
+    int cpu;
+};
+
+static int read_sys_int(const char *fmt, int cpu)
+{
+    char path[128];
+    snprintf(path, sizeof(path), fmt, cpu);
+
+    int value = -1;
+    FILE *file = fopen(path, "r");
+    if (file != NULL)
+    {
+        if (fscanf(file, "%d", &value) != 1)
+            value = -1;
+        fclose(file);
+    }
+    return value;
+}
+
+static int compare_topology(const void *lhs, const void *rhs)
+{
+    const struct cpu_topology *a = lhs;
+    const struct cpu_topology *b = rhs;
+    if (a->package != b->package)
+        return a->package - b->package;
+    if (a->cache != b->cache)
+        return a->cache - b->cache;
+    if (a->core != b->core)
+        return a->core - b->core;
+    return a->cpu - b->cpu;
+}
+
+static void init_cpu_rank(void)
+{
+    num_cpu_rank = (int)sysconf(_SC_NPROCESSORS_CONF);
+    if (num_cpu_rank < 1)
+        num_cpu_rank = 1;
+
+    struct cpu_topology *topology = malloc(sizeof(struct cpu_topology) * num_cpu_rank);
+    cpu_rank = malloc(sizeof(int) * num_cpu_rank);
+    if (topology == NULL || cpu_rank == NULL)
+        exit(-1);
+
+    for (int cpu = 0; cpu < num_cpu_rank; ++cpu)
+    {
+        topology[cpu].package = read_sys_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        topology[cpu].cache = read_sys_int("/sys/devices/system/cpu/cpu%d/cache/index3/id", cpu);
+        topology[cpu].core = read_sys_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        topology[cpu].cpu = cpu;
+    }
+    qsort(topology, num_cpu_rank, sizeof(struct cpu_topology), compare_topology);
+
+    for (int i = 0; i < num_cpu_rank; ++i)
+        cpu_rank[topology[i].cpu] = i;
+
+    free(topology);
+}
+
+static int rank_of(int cpu)
+{
+    return (cpu >= 0 && cpu < num_cpu_rank) ? cpu_rank[cpu] : num_cpu_rank;
+}
+
+static int compare_slots(const void *lhs, const void *rhs)
+{
+    const struct barrier_slot *a = *(struct barrier_slot *const *)lhs;
+    const struct barrier_slot *b = *(struct barrier_slot *const *)rhs;
+    int rank_a = rank_of(a->cpu);
+    int rank_b = rank_of(b->cpu);
+    if (rank_a != rank_b)
+        return rank_a - rank_b;
+    return (a < b) ? -1 : (a > b);
+}
+
+// sizes the tree level by level, leaves first, the root is the last node
+static int tree_nodes(int max, int *num_leaves)
+{
+    int width = (max + BARRIER_TREE_FANOUT - 1) / BARRIER_TREE_FANOUT;
+    int total = width;
+    *num_leaves = width;
+    while (width > 1)
+    {
+        width = (width + BARRIER_TREE_FANOUT - 1) / BARRIER_TREE_FANOUT;
+        total += width;
+    }
+    return total;
+}
+
+static void tree_init(struct barrier_t *barrier)
+{
+    pthread_once(&cpu_rank_once, init_cpu_rank);
+
+    int num_nodes = tree_nodes(barrier->max, &barrier->num_leaves);
+    barrier->nodes = aligned_alloc(CACHE_LINE, sizeof(struct barrier_node) * num_nodes);
+    barrier->slots = malloc(sizeof(struct barrier_slot) * barrier->max);
+    if (barrier->nodes == NULL || barrier->slots == NULL)
+        exit(-1);
+
+    // children of level i are numbered consecutively, so are their parents
+    int first = 0;
+    int width = barrier->num_leaves;
+    int children = barrier->max;
+    while (1)
+    {
+        int parents = (width + BARRIER_TREE_FANOUT - 1) / BARRIER_TREE_FANOUT;
+        for (int i = 0; i < width; ++i)
+        {
+            struct barrier_node *node = &barrier->nodes[first + i];
+            atomic_init(&node->count, 0);
+            node->expected = (i == width - 1) ? children - i * BARRIER_TREE_FANOUT : BARRIER_TREE_FANOUT;
+            node->parent = (width == 1) ? -1 : first + width + i / BARRIER_TREE_FANOUT;
+        }
+        if (width == 1)
+            break;
+        first += width;
+        children = width;
+        width = parents;
+    }
+
+    atomic_init(&barrier->registered, 0);
+    pthread_key_create(&barrier->slot_key, NULL);
+}
+
+// called by the last arriver of the first episode, everybody else is waiting
+static void tree_layout(struct barrier_t *barrier)
+{
+    struct barrier_slot **order = malloc(sizeof(struct barrier_slot *) * barrier->max);
+    if (order == NULL)
+        exit(-1);
+
+    for (int i = 0; i < barrier->max; ++i)
+        order[i] = &barrier->slots[i];
+    qsort(order, barrier->max, sizeof(struct barrier_slot *), compare_slots);
+
+    for (int i = 0; i < barrier->max; ++i)
+        order[i]->leaf = i / BARRIER_TREE_FANOUT;
+
+    free(order);
+}
+
+static void tree_register(struct barrier_t *barrier)
+{
+    int index = atomic_fetch_add_explicit(&barrier->registered, 1, memory_order_relaxed);
+    if (index >= barrier->max)
+    {
+        fprintf(stderr, "barrier: more than %d threads use this tree barrier\n", barrier->max);
+        exit(-1);
+    }
+
+    barrier->slots[index].cpu = sched_getcpu();
+    pthread_setspecific(barrier->slot_key, &barrier->slots[index]);
+}
+
+// returns non zero for the thread completing the episode
+static int arrive_central(struct barrier_t *barrier)
+{
+    if (atomic_fetch_add_explicit(&barrier->count, 1, memory_order_acq_rel) + 1 != barrier->max)
+        return 0;
+
+    // nobody can arrive for the next episode before the generation moves on,
+    // so the count can be reset before releasing the others
+    atomic_store_explicit(&barrier->count, 0, memory_order_relaxed);
+    return 1;
+}
+
+static int arrive_tree(struct barrier_t *barrier, const struct barrier_slot *slot)
+{
+    int index = slot->leaf;
+    while (index >= 0)
+    {
+        struct barrier_node *node = &barrier->nodes[index];
+        if (atomic_fetch_add_explicit(&node->count, 1, memory_order_acq_rel) + 1 != node->expected)
+            return 0;
+
+        // same argument as in arrive_central, the node is idle until the release
+        atomic_store_explicit(&node->count, 0, memory_order_relaxed);
+        index = node->parent;
+    }
+    return 1;
+}
+
+static void release(struct barrier_t *barrier, unsigned int generation)
+{
+    atomic_store(&barrier->generation, generation + 1);
+    if (atomic_load(&barrier->sleepers) > 0)
+        futex_wake_all(&barrier->generation);
+}
+
+static void await_generation(struct barrier_t *barrier, unsigned int generation)
+{
+    for (int i = 0; i < barrier->spin_limit; ++i)
+    {
+        if (atomic_load_explicit(&barrier->generation, memory_order_acquire) != generation)
+            return;
+        cpu_relax();
+    }
+
+    // announce ourselves before the last check, the releaser looks at sleepers
+    // after publishing the generation, so one of us always sees the other
+    atomic_fetch_add(&barrier->sleepers, 1);
+    while (atomic_load(&barrier->generation) == generation)
+        futex_wait(&barrier->generation, generation);
+    atomic_fetch_sub(&barrier->sleepers, 1);
+}
+
+void barrier_init(struct barrier_t *barrier,
+                  int max,
+                  enum barrier_kind kind,
+                  void (*completion)(void *),
+                  void *completion_arg)
+{
+    atomic_init(&barrier->generation, 0);
+    atomic_init(&barrier->sleepers, 0);
+    atomic_init(&barrier->count, 0);
+    barrier->max = max;
+    // spinning while the last thread waits for our core only delays it
+    barrier->spin_limit = max <= sysconf(_SC_NPROCESSORS_ONLN) ? BARRIER_SPIN_LIMIT : 0;
+    barrier->kind = kind;
+    barrier->completion = completion;
+    barrier->completion_arg = completion_arg;
+    barrier->nodes = NULL;
+    barrier->slots = NULL;
+
+    if (kind == BARRIER_TREE)
+        tree_init(barrier);
+}
+
+// First half of a split-phase wait: counts the caller in and returns at once.
+// The caller may do independent work before handing the token to
+// barrier_wait_token, but must not arrive again before that.
+barrier_token barrier_arrive(struct barrier_t *barrier)
+{
+    const unsigned int generation = atomic_load_explicit(&barrier->generation, memory_order_acquire);
+
+    int last;
+    if (barrier->kind == BARRIER_CENTRAL)
+    {
+        last = arrive_central(barrier);
+    }
+    else
+    {
+        const struct barrier_slot *slot = pthread_getspecific(barrier->slot_key);
+        if (slot != NULL)
+        {
+            last = arrive_tree(barrier, slot);
+        }
+        else
+        {
+            tree_register(barrier);
+            last = arrive_central(barrier);
+            if (last)
+                tree_layout(barrier);
+        }
+    }
+
+    if (last)
+    {
+        if (barrier->completion != NULL)
+            barrier->completion(barrier->completion_arg);
+        release(barrier, generation);
+    }
+
+    return generation;
+}
+
+// Second half of a split-phase wait: blocks until the episode of token is over.
+void barrier_wait_token(struct barrier_t *barrier, barrier_token token)
+{
+    await_generation(barrier, token);
+}
+
+void barrier_wait(struct barrier_t *barrier)
+{
+    barrier_wait_token(barrier, barrier_arrive(barrier));
+}
+
+void barrier_destroy(struct barrier_t *barrier)
+{
+    if (barrier->kind == BARRIER_TREE)
+    {
+        pthread_key_delete(barrier->slot_key);
+        free(barrier->nodes);
+        free(barrier->slots);
+    }
+}
+
+// The original mutex/condvar barrier, kept as a baseline for comparisons.
+// The generation guards against spurious wakeups and back-to-back episodes.
+struct cond_barrier_t
 {
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     int count;
     int max;
+    unsigned int generation;
 };
 
-void barrier_init(struct barrier_t *barrier, int max)
+void cond_barrier_init(struct cond_barrier_t *barrier, int max)
 {
     barrier->count = 0;
     barrier->max = max;
+    barrier->generation = 0;
     pthread_mutex_init(&barrier->mutex, NULL);
     pthread_cond_init(&barrier->cond, NULL);
 }
 
-void barrier_wait(struct barrier_t *barrier)
+void cond_barrier_wait(struct cond_barrier_t *barrier)
 {
     pthread_mutex_lock(&barrier->mutex);
+    unsigned int generation = barrier->generation;
     barrier->count++;
     if (barrier->count == barrier->max)
     {
-        pthread_cond_broadcast(&barrier->cond);
         // reset the barrier
         barrier->count = 0;
+        barrier->generation++;
+        pthread_cond_broadcast(&barrier->cond);
     }
     else
     {
-        pthread_cond_wait(&barrier->cond, &barrier->mutex);
+        while (generation == barrier->generation)
+            pthread_cond_wait(&barrier->cond, &barrier->mutex);
     }
     pthread_mutex_unlock(&barrier->mutex);
 }
 
-void barrier_destroy(struct barrier_t *barrier)
+void cond_barrier_destroy(struct cond_barrier_t *barrier)
 {
     pthread_mutex_destroy(&barrier->mutex);
     pthread_cond_destroy(&barrier->cond);
 }
 
-int get_rand_sleep_time()
+// Uniform handle over the barrier flavours so they can be compared head to head.
+struct barrier_impl
+{
+    const char *name;
+    void *(*create)(int max);
+    void (*wait)(void *barrier);
+    void (*destroy)(void *barrier);
+};
+
+static void *barrier_create(int max, enum barrier_kind kind)
+{
+    struct barrier_t *barrier = aligned_alloc(CACHE_LINE, sizeof(struct barrier_t));
+    if (barrier == NULL)
+        exit(-1);
+    barrier_init(barrier, max, kind, NULL, NULL);
+    return barrier;
+}
+
+static void *futex_create(int max)
+{
+    return barrier_create(max, BARRIER_CENTRAL);
+}
+
+static void *tree_create(int max)
+{
+    return barrier_create(max, BARRIER_TREE);
+}
+
+static void futex_wait_impl(void *barrier)
 {
-    return rand() % 100 + 750000;
+    barrier_wait((struct barrier_t *)barrier);
 }
 
-struct barrier_t barrier;
+static void futex_destroy(void *barrier)
+{
+    barrier_destroy((struct barrier_t *)barrier);
+    free(barrier);
+}
+
+// The futex barrier through barrier_arrive/barrier_wait_token with a
+// completion callback, so the split-phase path is measured and checked too.
+struct split_barrier_t
+{
+    struct barrier_t barrier;
+    // bumped by the completion of every episode
+    unsigned int completions;
+};
 
-void *thread_func(void *arg)
+static void count_completion(void *arg)
 {
-    int id = *((int *)arg);
-    int random_iterations = rand() % 20 + 1;
+    ++*(unsigned int *)arg;
+}
 
-    printf("Thread %d: I will iterate %d times\n", id, random_iterations);
+static void *split_create(int max)
+{
+    struct split_barrier_t *split = aligned_alloc(CACHE_LINE, sizeof(struct split_barrier_t));
+    if (split == NULL)
+        exit(-1);
+    split->completions = 0;
+    barrier_init(&split->barrier, max, BARRIER_CENTRAL, count_completion, &split->completions);
+    return split;
+}
 
-    for (int i = 0; i < random_iterations; i++)
+static void split_wait_impl(void *barrier)
+{
+    struct split_barrier_t *split = (struct split_barrier_t *)barrier;
+    barrier_token token = barrier_arrive(&split->barrier);
+    barrier_wait_token(&split->barrier, token);
+
+    // the completion ran once per episode up to ours, and the next one cannot
+    // complete before we arrive again
+    if (split->completions != token + 1)
     {
-        printf("Thread %d: %d\n", id, i);
-        usleep(get_rand_sleep_time());
+        fprintf(stderr, "split barrier: %u completions after episode %u\n", split->completions, token);
+        exit(-1);
     }
-    printf("Thread %d: I am waiting\n", id);
+}
+
+static void split_destroy(void *barrier)
+{
+    barrier_destroy(&((struct split_barrier_t *)barrier)->barrier);
+    free(barrier);
+}
+
+static void *cond_create(int max)
+{
+    struct cond_barrier_t *barrier = malloc(sizeof(struct cond_barrier_t));
+    if (barrier == NULL)
+        exit(-1);
+    cond_barrier_init(barrier, max);
+    return barrier;
+}
+
+static void cond_wait_impl(void *barrier)
+{
+    cond_barrier_wait((struct cond_barrier_t *)barrier);
+}
+
+static void cond_destroy(void *barrier)
+{
+    cond_barrier_destroy((struct cond_barrier_t *)barrier);
+    free(barrier);
+}
+
+static void *pthread_create_barrier(int max)
+{
+    pthread_barrier_t *barrier = malloc(sizeof(pthread_barrier_t));
+    if (barrier == NULL)
+        exit(-1);
+    pthread_barrier_init(barrier, NULL, max);
+    return barrier;
+}
+
+static void pthread_wait_impl(void *barrier)
+{
+    pthread_barrier_wait((pthread_barrier_t *)barrier);
+}
 
-    barrier_wait(&barrier);
+static void pthread_destroy_barrier(void *barrier)
+{
+    pthread_barrier_destroy((pthread_barrier_t *)barrier);
+    free(barrier);
+}
+
+static const struct barrier_impl impls[] = {
+    {"futex", futex_create, futex_wait_impl, futex_destroy},
+    {"tree", tree_create, futex_wait_impl, futex_destroy},
+    {"split", split_create, split_wait_impl, split_destroy},
+    {"condvar", cond_create, cond_wait_impl, cond_destroy},
+    {"pthread", pthread_create_barrier, pthread_wait_impl, pthread_destroy_barrier},
+};
+
+#define NUM_IMPLS ((int)(sizeof(impls) / sizeof(impls[0])))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// episodes run before measuring, they also register threads with a tree barrier
+#define WARMUP_EPISODES 1000
+
+struct bench_config
+{
+    int thread_counts[64];
+    int num_thread_counts;
+    long episodes;
+    int pin;
+    // NULL runs every implementation
+    const char *impl;
+};
+
+struct bench_shared
+{
+    const struct barrier_impl *impl;
+    void *barrier;
+    long episodes;
+    int pin;
+    // written by thread 0 only: time at which it left each episode
+    uint64_t *exits;
+};
 
-    printf("Thread %d: We are done!\n", id);
+struct bench_arg
+{
+    int id;
+    struct bench_shared *shared;
+};
+
+static void pin_to_cpu(int id)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void *bench_func(void *arg)
+{
+    struct bench_arg *bench_arg = (struct bench_arg *)arg;
+    struct bench_shared *shared = bench_arg->shared;
+    const struct barrier_impl *impl = shared->impl;
+    void *barrier = shared->barrier;
+
+    if (shared->pin)
+        pin_to_cpu(bench_arg->id);
+
+    for (int i = 0; i < WARMUP_EPISODES; ++i)
+        impl->wait(barrier);
+
+    if (bench_arg->id == 0)
+    {
+        uint64_t *exits = shared->exits;
+        exits[0] = now_ns();
+        for (long i = 1; i <= shared->episodes; ++i)
+        {
+            impl->wait(barrier);
+            exits[i] = now_ns();
+        }
+    }
+    else
+    {
+        for (long i = 0; i < shared->episodes; ++i)
+            impl->wait(barrier);
+    }
 
     return NULL;
 }
 
-int main(int argc, char **argv)
+static int compare_u64(const void *lhs, const void *rhs)
+{
+    uint64_t a = *(const uint64_t *)lhs;
+    uint64_t b = *(const uint64_t *)rhs;
+    return (a > b) - (a < b);
+}
+
+static uint64_t percentile(const uint64_t *sorted, long len, double p)
+{
+    long index = (long)(p * (len - 1));
+    return sorted[index];
+}
+
+// One back-to-back run, printed as a csv row. The latency of an episode is the
+// time between thread 0 leaving the previous episode and leaving this one.
+void bench_one(const struct barrier_impl *impl, int threads, const struct bench_config *config)
 {
-    barrier_init(&barrier, N);
+    pthread_t *handles = malloc(sizeof(pthread_t) * threads);
+    struct bench_arg *args = malloc(sizeof(struct bench_arg) * threads);
+    uint64_t *exits = malloc(sizeof(uint64_t) * (config->episodes + 1));
+    if (handles == NULL || args == NULL || exits == NULL)
+        exit(-1);
 
-    pthread_t threads[N];
-    int ids[N];
+    struct bench_shared shared = {impl, impl->create(threads), config->episodes, config->pin, exits};
 
-    for (int i = 0; i < N; ++i)
+    for (int i = 0; i < threads; ++i)
     {
-        pthread_t thread;
-        // store the id it will be lost otherwise. I love C.
-        ids[i] = i;
-        pthread_create(&thread, NULL, thread_func, ((void *)(ids + i)));
-        threads[i] = thread;
+        args[i].id = i;
+        args[i].shared = &shared;
+        pthread_create(&handles[i], NULL, bench_func, args + i);
     }
+    for (int i = 0; i < threads; ++i)
+        pthread_join(handles[i], NULL);
+
+    impl->destroy(shared.barrier);
+
+    const long episodes = config->episodes;
+    const double seconds = (exits[episodes] - exits[0]) / 1e9;
+
+    // turn exit times into episode latencies in place
+    for (long i = 0; i < episodes; ++i)
+        exits[i] = exits[i + 1] - exits[i];
+    qsort(exits, episodes, sizeof(uint64_t), compare_u64);
+
+    printf("%s,%d,%d,%ld,%.0f,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+           impl->name,
+           threads,
+           config->pin,
+           episodes,
+           episodes / seconds,
+           seconds * 1e9 / episodes,
+           percentile(exits, episodes, 0.5),
+           percentile(exits, episodes, 0.9),
+           percentile(exits, episodes, 0.99),
+           percentile(exits, episodes, 0.999),
+           exits[episodes - 1]);
+    fflush(stdout);
+
+    free(exits);
+    free(args);
+    free(handles);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads[,threads...]] [-e episodes] [-p] [-i impl]\n"
+            "  -t  thread counts to run, default 2,4,8,16\n"
+            "  -e  measured episodes per run, default 1000000\n"
+            "  -p  pin thread i to cpu i modulo the online cpus\n"
+            "  -i  only run one of:",
+            name);
+    for (int i = 0; i < NUM_IMPLS; ++i)
+        fprintf(stderr, " %s", impls[i].name);
+    fprintf(stderr, "\n");
+    exit(-1);
+}
+
+static void parse_thread_counts(struct bench_config *config, char *list, const char *name)
+{
+    config->num_thread_counts = 0;
+    for (char *token = strtok(list, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        int threads = atoi(token);
+        if (threads < 1 || config->num_thread_counts == 64)
+            usage(name);
+        config->thread_counts[config->num_thread_counts++] = threads;
+    }
+    if (config->num_thread_counts == 0)
+        usage(name);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config = {{2, 4, 8, 16}, 4, 1000000, 0, NULL};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:e:pi:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            parse_thread_counts(&config, optarg, argv[0]);
+            break;
+        case 'e':
+            config.episodes = atol(optarg);
+            if (config.episodes < 1)
+                usage(argv[0]);
+            break;
+        case 'p':
+            config.pin = 1;
+            break;
+        case 'i':
+            config.impl = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    int found = config.impl == NULL;
+    for (int i = 0; i < NUM_IMPLS; ++i)
+        found |= config.impl != NULL && strcmp(config.impl, impls[i].name) == 0;
+    if (!found)
+        usage(argv[0]);
 
-    for (int i = 0; i < N; ++i)
+    printf("impl,threads,pinned,episodes,episodes_per_sec,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    for (int t = 0; t < config.num_thread_counts; ++t)
     {
-        pthread_join(threads[i], NULL);
+        for (int i = 0; i < NUM_IMPLS; ++i)
+        {
+            if (config.impl == NULL || strcmp(config.impl, impls[i].name) == 0)
+                bench_one(&impls[i], config.thread_counts[t], &config);
+        }
     }
 
     return 0;
@@ -1,7 +1,17 @@
+#define _GNU_SOURCE // usleep with -std=c11
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
 #include <time.h>
+#include <sched.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdalign.h>
 
 #define UNUSED(expr)  \
     do                \
@@ -11,76 +21,723 @@
 
 #define MAX_ITER (100000)
 
+#define CACHE_LINE 64
+// default for initBuffer: busy polls before a blocked side yields its core
+// (lock free modes), or the most it polls before going to sleep on a
+// condition variable (BUFFER_LOCKED)
+#define SPIN_LIMIT 128
+
+enum BufferMode
+{
+    // one mutex around every operation, sleeping on not full / not empty
+    BUFFER_LOCKED,
+    // lock free, exactly one producer thread and one consumer thread
+    BUFFER_SPSC,
+    // lock free, any number of producers and consumers
+    BUFFER_MPMC,
+};
+
+// BUFFER_MPMC slot. A slot at position pos is free for the producer that
+// claims pos when sequence == pos, and holds data for the consumer that
+// claims pos when sequence == pos + 1.
+struct Cell
+{
+    atomic_size_t sequence;
+    char data;
+};
+
 struct Buffer
 {
+    enum BufferMode mode;
+
     char *buf;
     int in;
     int out;
-    int count;
+    // only changed under m, read without it while spinning
+    atomic_int count;
     int size;
+    int spinLimit;
+    // BUFFER_LOCKED: moving averages of how long a blocked put / get polled
+    // before its wait ended, only changed under m
+    atomic_int putSpins;
+    atomic_int getSpins;
 
     pthread_mutex_t m;
-    pthread_cond_t c;
+    pthread_cond_t notFull;
+    pthread_cond_t notEmpty;
+    // threads sleeping on notFull / notEmpty, nobody is signalled if zero.
+    // batchWaiters sleep on notFull for more than one slot, one signal per
+    // freed slot could go to them and be lost for a plain put.
+    int putWaiters;
+    int getWaiters;
+    int batchWaiters;
+
+    // BUFFER_SPSC: head and tail run freely and are wrapped with mask. Each side
+    // keeps a possibly stale copy of the other side's index and only reloads it
+    // when the copy says full (or empty), so the shared lines rarely move.
+    size_t mask;
+    alignas(CACHE_LINE) atomic_size_t head;
+    size_t cachedTail;
+    // producer side end of the record handed out by reserve
+    size_t reserved;
+    alignas(CACHE_LINE) atomic_size_t tail;
+    size_t cachedHead;
+    // consumer side end of the record handed out by peek
+    size_t peeked;
+
+    // BUFFER_MPMC: producers and consumers only meet on the cell they claimed
+    struct Cell *cells;
+    alignas(CACHE_LINE) atomic_size_t enqueuePos;
+    alignas(CACHE_LINE) atomic_size_t dequeuePos;
 };
 
-void put(struct Buffer *b, char c)
+static inline void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Lock free modes: a fixed spinLimit polls, then the core is yielded.
+static void backoff(const struct Buffer *b, int *spins)
+{
+    if (++(*spins) < b->spinLimit)
+    {
+        cpuRelax();
+    }
+    else
+    {
+        *spins = 0;
+        sched_yield();
+    }
+}
+
+static void putSpsc(struct Buffer *b, char c)
+{
+    const size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+
+    if (head - b->cachedTail > b->mask)
+    {
+        int spins = 0;
+        while (head - (b->cachedTail = atomic_load_explicit(&b->tail, memory_order_acquire)) > b->mask)
+            backoff(b, &spins);
+    }
+
+    b->buf[head & b->mask] = c;
+    atomic_store_explicit(&b->head, head + 1, memory_order_release);
+}
+
+static char getSpsc(struct Buffer *b)
+{
+    const size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+
+    if (tail == b->cachedHead)
+    {
+        int spins = 0;
+        while (tail == (b->cachedHead = atomic_load_explicit(&b->head, memory_order_acquire)))
+            backoff(b, &spins);
+    }
+
+    char c = b->buf[tail & b->mask];
+    atomic_store_explicit(&b->tail, tail + 1, memory_order_release);
+    return c;
+}
+
+static void putMpmc(struct Buffer *b, char c)
+{
+    struct Cell *cell;
+    size_t pos = atomic_load_explicit(&b->enqueuePos, memory_order_relaxed);
+    int spins = 0;
+
+    while (1)
+    {
+        cell = &b->cells[pos & b->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)(sequence - pos);
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&b->enqueuePos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else
+        {
+            // full if the consumer of the previous lap has not freed the cell yet
+            if (diff < 0)
+                backoff(b, &spins);
+            pos = atomic_load_explicit(&b->enqueuePos, memory_order_relaxed);
+        }
+    }
+
+    cell->data = c;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+}
+
+static char getMpmc(struct Buffer *b)
 {
-    printf("put\n");
+    struct Cell *cell;
+    size_t pos = atomic_load_explicit(&b->dequeuePos, memory_order_relaxed);
+    int spins = 0;
+
+    while (1)
+    {
+        cell = &b->cells[pos & b->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)(sequence - (pos + 1));
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&b->dequeuePos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else
+        {
+            // empty if no producer has filled the cell yet
+            if (diff < 0)
+                backoff(b, &spins);
+            pos = atomic_load_explicit(&b->dequeuePos, memory_order_relaxed);
+        }
+    }
+
+    char c = cell->data;
+    // hand the cell to the producer of the next lap
+    atomic_store_explicit(&cell->sequence, pos + b->mask + 1, memory_order_release);
+    return c;
+}
+
+static int freeLocked(struct Buffer *b)
+{
+    return b->size - atomic_load_explicit(&b->count, memory_order_relaxed);
+}
+
+// How long a blocked side of BUFFER_LOCKED polls before taking the lock: a
+// bit more than it recently took, capped by spinLimit, like glibc's adaptive
+// mutexes. Waits that end up sleeping pull the estimate down.
+static int spinBudget(const struct Buffer *b, const atomic_int *estimate)
+{
+    int budget = 2 * atomic_load_explicit(estimate, memory_order_relaxed) + 10;
+    return budget < b->spinLimit ? budget : b->spinLimit;
+}
+
+// Called with m held, spins is how long the wait polled, 0 if it slept.
+static void updateSpins(atomic_int *estimate, int spins)
+{
+    int old = atomic_load_explicit(estimate, memory_order_relaxed);
+    atomic_store_explicit(estimate, old + (spins - old) / 8, memory_order_relaxed);
+}
+
+// Waits with m held until k slots are free. Spins first without the lock, a
+// consumer is often just about to make room.
+static void lockNotFull(struct Buffer *b, int k)
+{
+    const int budget = spinBudget(b, &b->putSpins);
+    int spins = 0;
+    while (spins < budget && freeLocked(b) < k)
+    {
+        cpuRelax();
+        ++spins;
+    }
+
+    pthread_mutex_lock(&b->m);
+    if (freeLocked(b) >= k)
+    {
+        if (spins > 0)
+            updateSpins(&b->putSpins, spins);
+        return;
+    }
+
+    updateSpins(&b->putSpins, 0);
+    ++(b->putWaiters);
+    if (k > 1)
+        ++(b->batchWaiters);
+    while (freeLocked(b) < k)
+    {
+        pthread_cond_wait(&b->notFull, &b->m);
+    }
+    if (k > 1)
+        --(b->batchWaiters);
+    --(b->putWaiters);
+}
+
+// Waits with m held until something is available, spinning first as above.
+static void lockNotEmpty(struct Buffer *b)
+{
+    const int budget = spinBudget(b, &b->getSpins);
+    int spins = 0;
+    while (spins < budget && freeLocked(b) == b->size)
+    {
+        cpuRelax();
+        ++spins;
+    }
 
     pthread_mutex_lock(&b->m);
-    while (b->count == b->size)
+    if (freeLocked(b) < b->size)
     {
-        pthread_cond_wait(&b->c, &b->m);
+        if (spins > 0)
+            updateSpins(&b->getSpins, spins);
+        return;
     }
 
+    updateSpins(&b->getSpins, 0);
+    ++(b->getWaiters);
+    while (freeLocked(b) == b->size)
+    {
+        pthread_cond_wait(&b->notEmpty, &b->m);
+    }
+    --(b->getWaiters);
+}
+
+// Called with m held after n slots were filled.
+static void wakeConsumers(struct Buffer *b, int n)
+{
+    if (b->getWaiters == 0)
+        return;
+    if (n == 1)
+        pthread_cond_signal(&b->notEmpty);
+    else
+        pthread_cond_broadcast(&b->notEmpty);
+}
+
+// Called with m held after n slots were freed.
+static void wakeProducers(struct Buffer *b, int n)
+{
+    if (b->putWaiters == 0)
+        return;
+    if (n == 1 && b->batchWaiters == 0)
+        pthread_cond_signal(&b->notFull);
+    else
+        pthread_cond_broadcast(&b->notFull);
+}
+
+static void addCount(struct Buffer *b, int n)
+{
+    atomic_store_explicit(&b->count, atomic_load_explicit(&b->count, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void put(struct Buffer *b, char c)
+{
+    if (b->mode == BUFFER_SPSC)
+    {
+        putSpsc(b, c);
+        return;
+    }
+    if (b->mode == BUFFER_MPMC)
+    {
+        putMpmc(b, c);
+        return;
+    }
+
+    lockNotFull(b, 1);
+
     b->buf[b->in] = c;
     b->in = (b->in + 1) % b->size;
-    ++(b->count);
+    addCount(b, 1);
 
-    pthread_cond_signal(&b->c);
+    wakeConsumers(b, 1);
     pthread_mutex_unlock(&b->m);
 }
 
 char get(struct Buffer *b)
 {
-    printf("get\n");
+    if (b->mode == BUFFER_SPSC)
+        return getSpsc(b);
+    if (b->mode == BUFFER_MPMC)
+        return getMpmc(b);
 
-    pthread_mutex_lock(&b->m);
-    while (b->count == 0)
-    {
-        pthread_cond_wait(&b->c, &b->m);
-    }
+    lockNotEmpty(b);
 
     char c = b->buf[b->out];
     b->buf[b->out] = '\0';
     b->out = (b->out + 1) % b->size;
-    --(b->count);
+    addCount(b, -1);
 
-    pthread_cond_signal(&b->c);
+    wakeProducers(b, 1);
     pthread_mutex_unlock(&b->m);
 
     return c;
 }
 
-void initBuffer(struct Buffer *b, int size)
+// copies n bytes into buf starting at index, wrapping at most once
+static void copyIn(char *buf, int size, int index, const char *src, int n)
+{
+    int first = (n < size - index) ? n : size - index;
+    memcpy(buf + index, src, first);
+    memcpy(buf, src + first, n - first);
+}
+
+static void copyOut(const char *buf, int size, int index, char *dst, int n)
+{
+    int first = (n < size - index) ? n : size - index;
+    memcpy(dst, buf + index, first);
+    memcpy(dst + first, buf, n - first);
+}
+
+static void putNSpsc(struct Buffer *b, const char *src, int n)
+{
+    size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+    const size_t size = b->mask + 1;
+
+    while (n > 0)
+    {
+        size_t free = size - (head - b->cachedTail);
+        if (free == 0)
+        {
+            int spins = 0;
+            while ((free = size - (head - (b->cachedTail = atomic_load_explicit(&b->tail, memory_order_acquire)))) == 0)
+                backoff(b, &spins);
+        }
+
+        int chunk = (size_t)n < free ? n : (int)free;
+        copyIn(b->buf, (int)size, (int)(head & b->mask), src, chunk);
+        head += chunk;
+        atomic_store_explicit(&b->head, head, memory_order_release);
+
+        src += chunk;
+        n -= chunk;
+    }
+}
+
+static int getNSpsc(struct Buffer *b, char *dst, int max)
+{
+    const size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+
+    size_t available = b->cachedHead - tail;
+    if (available == 0)
+    {
+        int spins = 0;
+        while ((available = (b->cachedHead = atomic_load_explicit(&b->head, memory_order_acquire)) - tail) == 0)
+            backoff(b, &spins);
+    }
+
+    int chunk = (size_t)max < available ? max : (int)available;
+    copyOut(b->buf, (int)(b->mask + 1), (int)(tail & b->mask), dst, chunk);
+    atomic_store_explicit(&b->tail, tail + chunk, memory_order_release);
+    return chunk;
+}
+
+// Claims as many consecutive cells as are ready, up to n, with a single CAS.
+// ready is the sequence a cell at pos has when it can be claimed minus pos.
+static int claimMpmc(struct Buffer *b, atomic_size_t *position, size_t ready, int n, size_t *claimed)
+{
+    size_t pos = atomic_load_explicit(position, memory_order_relaxed);
+    int spins = 0;
+
+    while (1)
+    {
+        int count = 0;
+        while (count < n &&
+               atomic_load_explicit(&b->cells[(pos + count) & b->mask].sequence, memory_order_acquire) == pos + count + ready)
+            ++count;
+
+        if (count == 0)
+        {
+            size_t sequence = atomic_load_explicit(&b->cells[pos & b->mask].sequence, memory_order_relaxed);
+            // behind by a lap: full for producers, empty for consumers
+            if ((ptrdiff_t)(sequence - (pos + ready)) < 0)
+                backoff(b, &spins);
+            pos = atomic_load_explicit(position, memory_order_relaxed);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(position, &pos, pos + count,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        {
+            *claimed = pos;
+            return count;
+        }
+    }
+}
+
+static void putNMpmc(struct Buffer *b, const char *src, int n)
+{
+    while (n > 0)
+    {
+        size_t pos;
+        int count = claimMpmc(b, &b->enqueuePos, 0, n, &pos);
+        // cells are published one by one, each carries its own sequence
+        for (int i = 0; i < count; ++i)
+        {
+            struct Cell *cell = &b->cells[(pos + i) & b->mask];
+            cell->data = src[i];
+            atomic_store_explicit(&cell->sequence, pos + i + 1, memory_order_release);
+        }
+        src += count;
+        n -= count;
+    }
+}
+
+static int getNMpmc(struct Buffer *b, char *dst, int max)
+{
+    size_t pos;
+    int count = claimMpmc(b, &b->dequeuePos, 1, max, &pos);
+    for (int i = 0; i < count; ++i)
+    {
+        struct Cell *cell = &b->cells[(pos + i) & b->mask];
+        dst[i] = cell->data;
+        atomic_store_explicit(&cell->sequence, pos + i + b->mask + 1, memory_order_release);
+    }
+    return count;
+}
+
+// Puts all n bytes of src, blocking while the buffer is full. Synchronizes once
+// per batch that fits instead of once per byte. n <= 0 puts nothing.
+void put_n(struct Buffer *b, const char *src, int n)
+{
+    if (n <= 0)
+        return;
+    if (b->mode == BUFFER_SPSC)
+    {
+        putNSpsc(b, src, n);
+        return;
+    }
+    if (b->mode == BUFFER_MPMC)
+    {
+        putNMpmc(b, src, n);
+        return;
+    }
+
+    while (n > 0)
+    {
+        lockNotFull(b, 1);
+
+        int free = freeLocked(b);
+        int chunk = (n < free) ? n : free;
+        copyIn(b->buf, b->size, b->in, src, chunk);
+        b->in = (b->in + chunk) % b->size;
+        addCount(b, chunk);
+        src += chunk;
+        n -= chunk;
+
+        // a batch can satisfy more than one consumer
+        wakeConsumers(b, chunk);
+        pthread_mutex_unlock(&b->m);
+    }
+}
+
+// Blocks until at least one byte is available, then takes up to max bytes.
+// Returns how many bytes were written to dst, 0 right away if max <= 0.
+int get_n(struct Buffer *b, char *dst, int max)
+{
+    if (max <= 0)
+        return 0;
+    if (b->mode == BUFFER_SPSC)
+        return getNSpsc(b, dst, max);
+    if (b->mode == BUFFER_MPMC)
+        return getNMpmc(b, dst, max);
+
+    lockNotEmpty(b);
+
+    int used = b->size - freeLocked(b);
+    int chunk = (max < used) ? max : used;
+    copyOut(b->buf, b->size, b->out, dst, chunk);
+    b->out = (b->out + chunk) % b->size;
+    addCount(b, -chunk);
+
+    wakeProducers(b, chunk);
+    pthread_mutex_unlock(&b->m);
+
+    return chunk;
+}
+
+// Blocks until at least k (at most the capacity) slots are free and returns the
+// number of free slots seen. Only a single producer can rely on them staying free.
+int wait_free(struct Buffer *b, int k)
+{
+    if (k > b->size)
+        k = b->size;
+
+    if (b->mode == BUFFER_LOCKED)
+    {
+        lockNotFull(b, k);
+        int free = freeLocked(b);
+        pthread_mutex_unlock(&b->m);
+        return free;
+    }
+
+    atomic_size_t *produced = (b->mode == BUFFER_SPSC) ? &b->head : &b->enqueuePos;
+    atomic_size_t *consumed = (b->mode == BUFFER_SPSC) ? &b->tail : &b->dequeuePos;
+    int spins = 0;
+    while (1)
+    {
+        size_t used = atomic_load_explicit(produced, memory_order_relaxed) -
+                      atomic_load_explicit(consumed, memory_order_acquire);
+        // a consumer may have claimed cells that are not filled yet
+        if ((ptrdiff_t)used < 0)
+            used = 0;
+        if (b->size - (int)used >= k)
+            return b->size - (int)used;
+        backoff(b, &spins);
+    }
+}
+
+// Records on a BUFFER_SPSC buffer: a uint32_t length, the payload, padding up
+// to the next multiple of 4. A record never wraps. If it does not fit before
+// the end of the ring, a RECORD_PAD header fills the rest and the record starts
+// at index 0. Do not mix records with put/get on the same buffer.
+#define RECORD_HEADER ((int)sizeof(uint32_t))
+#define RECORD_PAD UINT32_MAX
+
+static size_t recordSize(int len)
+{
+    return ((size_t)RECORD_HEADER + len + 3) & ~(size_t)3;
+}
+
+// producer side: blocks until need bytes past head are free
+static void waitRing(struct Buffer *b, size_t head, size_t need)
+{
+    const size_t size = b->mask + 1;
+    if (size - (head - b->cachedTail) < need)
+    {
+        int spins = 0;
+        while (size - (head - (b->cachedTail = atomic_load_explicit(&b->tail, memory_order_acquire))) < need)
+            backoff(b, &spins);
+    }
+}
+
+// Blocks until len bytes can be written straight into the ring and returns
+// where they go. Nothing is visible to the consumer before commit. Returns NULL
+// if the record can never fit.
+char *reserve(struct Buffer *b, int len)
+{
+    const size_t size = b->mask + 1;
+    const size_t total = recordSize(len);
+    if (b->mode != BUFFER_SPSC || len < 0 || total > size)
+        return NULL;
+
+    size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+    const size_t toEnd = size - (head & b->mask);
+
+    uint32_t header;
+    if (toEnd < total)
+    {
+        // the padding is published on its own, pad and record together may
+        // not fit into the ring at all
+        waitRing(b, head, toEnd);
+        header = RECORD_PAD;
+        memcpy(b->buf + (head & b->mask), &header, RECORD_HEADER);
+        head += toEnd;
+        atomic_store_explicit(&b->head, head, memory_order_release);
+    }
+    waitRing(b, head, total);
+
+    header = (uint32_t)len;
+    memcpy(b->buf + (head & b->mask), &header, RECORD_HEADER);
+    b->reserved = head + total;
+
+    return b->buf + (head & b->mask) + RECORD_HEADER;
+}
+
+// Publishes the record handed out by the last reserve.
+void commit(struct Buffer *b)
+{
+    atomic_store_explicit(&b->head, b->reserved, memory_order_release);
+}
+
+// Blocks until a record is available and returns its payload in place. The
+// payload stays valid until release.
+const char *peek(struct Buffer *b, int *len)
+{
+    const size_t size = b->mask + 1;
+    size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+
+    while (1)
+    {
+        if (tail == b->cachedHead)
+        {
+            int spins = 0;
+            while (tail == (b->cachedHead = atomic_load_explicit(&b->head, memory_order_acquire)))
+                backoff(b, &spins);
+        }
+
+        uint32_t header;
+        memcpy(&header, b->buf + (tail & b->mask), RECORD_HEADER);
+        if (header != RECORD_PAD)
+        {
+            *len = (int)header;
+            b->peeked = tail + recordSize(*len);
+            return b->buf + (tail & b->mask) + RECORD_HEADER;
+        }
+
+        // the producer skipped the end of the ring, it may be waiting for that space
+        tail += size - (tail & b->mask);
+        atomic_store_explicit(&b->tail, tail, memory_order_release);
+    }
+}
+
+// Hands the space of the record returned by the last peek back to the producer.
+void release(struct Buffer *b)
+{
+    atomic_store_explicit(&b->tail, b->peeked, memory_order_release);
+}
+
+static int nextPowerOfTwo(int n)
+{
+    int p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+// BUFFER_SPSC and BUFFER_MPMC round size up to the next power of two.
+// spinLimit is how long a blocked side polls before yielding, or at most
+// polls before sleeping in BUFFER_LOCKED. 0 never spins.
+void initBuffer(struct Buffer *b, int size, enum BufferMode mode, int spinLimit)
 {
     pthread_mutex_init(&b->m, NULL);
-    pthread_cond_init(&b->c, NULL);
+    pthread_cond_init(&b->notFull, NULL);
+    pthread_cond_init(&b->notEmpty, NULL);
 
+    if (mode == BUFFER_SPSC)
+        size = nextPowerOfTwo(size);
+    // a single cell cannot tell a full lap from an empty one
+    if (mode == BUFFER_MPMC)
+        size = nextPowerOfTwo(size < 2 ? 2 : size);
+
+    b->mode = mode;
     b->in = 0;
     b->out = 0;
-    b->count = 0;
+    atomic_init(&b->count, 0);
     b->size = size;
+    b->spinLimit = spinLimit;
+    atomic_init(&b->putSpins, 0);
+    atomic_init(&b->getSpins, 0);
+    b->putWaiters = 0;
+    b->getWaiters = 0;
+    b->batchWaiters = 0;
+    b->mask = (size_t)size - 1;
+    atomic_init(&b->head, 0);
+    atomic_init(&b->tail, 0);
+    b->cachedHead = 0;
+    b->cachedTail = 0;
+    b->reserved = 0;
+    b->peeked = 0;
+    atomic_init(&b->enqueuePos, 0);
+    atomic_init(&b->dequeuePos, 0);
+    b->cells = NULL;
     b->buf = (char *)malloc(sizeof(char) * size);
     if (b->buf == NULL)
         exit(-1);
+
+    if (mode == BUFFER_MPMC)
+    {
+        b->cells = (struct Cell *)malloc(sizeof(struct Cell) * size);
+        if (b->cells == NULL)
+            exit(-1);
+        for (int i = 0; i < size; ++i)
+            atomic_init(&b->cells[i].sequence, (size_t)i);
+    }
 }
 
 void destroyBuffer(struct Buffer *b)
 {
     pthread_mutex_destroy(&b->m);
-    pthread_cond_destroy(&b->c);
+    pthread_cond_destroy(&b->notFull);
+    pthread_cond_destroy(&b->notEmpty);
 
+    free(b->cells);
     free(b->buf);
 }
 
@@ -115,17 +772,399 @@ void *consumerFunc(void *param)
     return NULL;
 }
 
+static double nowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t nowNanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// producer ids travel as the item itself
+#define MAX_PRODUCERS 256
+
+struct BenchConfig
+{
+    // -1 runs every mode that fits the producer/consumer counts
+    int mode;
+    int producers;
+    int consumers;
+    int size;
+    long messages;
+    int batch;
+    int spinLimit;
+};
+
+// Per producer state. putTimes[i] is when the producer's i-th item went in,
+// taken counts that producer's items consumed so far. putTimes are atomic
+// because a consumer may read one the producer is still writing, see
+// benchConsumer.
+struct BenchLane
+{
+    alignas(CACHE_LINE) atomic_long taken;
+    _Atomic uint64_t *putTimes;
+};
+
+struct BenchArg
+{
+    struct Buffer *b;
+    struct BenchLane *lanes;
+    int id;
+    long messages;
+    int batch;
+    // consumers: one enqueue-to-dequeue latency per message
+    uint64_t *latencies;
+};
+
+void *benchProducer(void *param)
+{
+    struct BenchArg *arg = (struct BenchArg *)param;
+    _Atomic uint64_t *putTimes = arg->lanes[arg->id].putTimes;
+    char *batch = malloc(arg->batch);
+    if (batch == NULL)
+        exit(-1);
+    memset(batch, (char)arg->id, arg->batch);
+
+    for (long i = 0; i < arg->messages;)
+    {
+        int n = (arg->messages - i < arg->batch) ? (int)(arg->messages - i) : arg->batch;
+        uint64_t now = nowNanos();
+        for (int j = 0; j < n; ++j)
+            atomic_store_explicit(&putTimes[i + j], now, memory_order_relaxed);
+
+        if (n == 1)
+            put(arg->b, batch[0]);
+        else
+            put_n(arg->b, batch, n);
+        i += n;
+    }
+
+    free(batch);
+    return NULL;
+}
+
+// With one consumer every latency is exact. With several, a consumer numbers
+// the items it took per producer in the order it gets to count them, not the
+// order they were put, so a sample can belong to an item up to a batch away,
+// even one whose put time is later than now. Those are clamped to 0.
+void *benchConsumer(void *param)
+{
+    struct BenchArg *arg = (struct BenchArg *)param;
+    char *batch = malloc(arg->batch);
+    if (batch == NULL)
+        exit(-1);
+
+    for (long i = 0; i < arg->messages;)
+    {
+        int max = (arg->messages - i < arg->batch) ? (int)(arg->messages - i) : arg->batch;
+        int n = 1;
+        if (max == 1)
+            batch[0] = get(arg->b);
+        else
+            n = get_n(arg->b, batch, max);
+
+        uint64_t now = nowNanos();
+        for (int j = 0; j < n; ++j)
+        {
+            struct BenchLane *lane = &arg->lanes[(unsigned char)batch[j]];
+            long seq = atomic_fetch_add_explicit(&lane->taken, 1, memory_order_relaxed);
+            uint64_t put = atomic_load_explicit(&lane->putTimes[seq], memory_order_relaxed);
+            arg->latencies[i + j] = now > put ? now - put : 0;
+        }
+        i += n;
+    }
+
+    free(batch);
+    return NULL;
+}
+
+static int compareU64(const void *lhs, const void *rhs)
+{
+    uint64_t a = *(const uint64_t *)lhs;
+    uint64_t b = *(const uint64_t *)rhs;
+    return (a > b) - (a < b);
+}
+
+static const char *modeName(enum BufferMode mode)
+{
+    switch (mode)
+    {
+    case BUFFER_LOCKED:
+        return "locked";
+    case BUFFER_SPSC:
+        return "spsc";
+    case BUFFER_MPMC:
+        return "mpmc";
+    }
+    return "?";
+}
+
+// one run, printed as a csv row, nothing but put/get and timestamps in the hot path
+void benchOne(enum BufferMode mode, const struct BenchConfig *config)
+{
+    const int producers = config->producers;
+    const int consumers = config->consumers;
+    const long messages = config->messages;
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (producers + consumers));
+    struct BenchArg *args = malloc(sizeof(struct BenchArg) * (producers + consumers));
+    struct BenchLane *lanes = aligned_alloc(CACHE_LINE, sizeof(struct BenchLane) * producers);
+    _Atomic uint64_t *putTimes = malloc(sizeof(_Atomic uint64_t) * messages);
+    uint64_t *latencies = malloc(sizeof(uint64_t) * messages);
+    if (threads == NULL || args == NULL || lanes == NULL || putTimes == NULL || latencies == NULL)
+        exit(-1);
+
+    struct Buffer b;
+    initBuffer(&b, config->size, mode, config->spinLimit);
+
+    long offset = 0;
+    for (int i = 0; i < producers; ++i)
+    {
+        args[i].b = &b;
+        args[i].lanes = lanes;
+        args[i].id = i;
+        args[i].messages = messages / producers + (i < messages % producers);
+        args[i].batch = config->batch;
+        args[i].latencies = NULL;
+        atomic_init(&lanes[i].taken, 0);
+        lanes[i].putTimes = putTimes + offset;
+        offset += args[i].messages;
+    }
+    offset = 0;
+    for (int i = 0; i < consumers; ++i)
+    {
+        struct BenchArg *arg = &args[producers + i];
+        arg->b = &b;
+        arg->lanes = lanes;
+        arg->id = i;
+        arg->messages = messages / consumers + (i < messages % consumers);
+        arg->batch = config->batch;
+        arg->latencies = latencies + offset;
+        offset += arg->messages;
+    }
+
+    uint64_t start = nowNanos();
+    for (int i = 0; i < producers; ++i)
+        pthread_create(&threads[i], NULL, benchProducer, &args[i]);
+    for (int i = 0; i < consumers; ++i)
+        pthread_create(&threads[producers + i], NULL, benchConsumer, &args[producers + i]);
+    for (int i = 0; i < producers + consumers; ++i)
+        pthread_join(threads[i], NULL);
+    double seconds = (nowNanos() - start) / 1e9;
+
+    destroyBuffer(&b);
+
+    qsort(latencies, messages, sizeof(uint64_t), compareU64);
+    printf("%s,%d,%d,%d,%d,%ld,%.0f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+           modeName(mode),
+           producers,
+           consumers,
+           b.size,
+           config->batch,
+           messages,
+           messages / seconds,
+           latencies[(long)(0.5 * (messages - 1))],
+           latencies[(long)(0.9 * (messages - 1))],
+           latencies[(long)(0.99 * (messages - 1))],
+           latencies[(long)(0.999 * (messages - 1))],
+           latencies[messages - 1]);
+    fflush(stdout);
+
+    free(latencies);
+    free(putTimes);
+    free(lanes);
+    free(args);
+    free(threads);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: ./main bench [-m locked|spsc|mpmc] [-p producers] [-c consumers]\n"
+            "                    [-s size] [-n messages] [-b batch] [-S spin limit]\n");
+    exit(-1);
+}
+
+int bench(int argc, char **argv)
+{
+    struct BenchConfig config = {-1, 1, 1, 1024, 1000000, 1, SPIN_LIMIT};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:p:c:s:n:b:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            if (strcmp(optarg, "locked") == 0)
+                config.mode = BUFFER_LOCKED;
+            else if (strcmp(optarg, "spsc") == 0)
+                config.mode = BUFFER_SPSC;
+            else if (strcmp(optarg, "mpmc") == 0)
+                config.mode = BUFFER_MPMC;
+            else
+                usage();
+            break;
+        case 'p':
+            config.producers = atoi(optarg);
+            break;
+        case 'c':
+            config.consumers = atoi(optarg);
+            break;
+        case 's':
+            config.size = atoi(optarg);
+            break;
+        case 'n':
+            config.messages = atol(optarg);
+            break;
+        case 'b':
+            config.batch = atoi(optarg);
+            break;
+        case 'S':
+            config.spinLimit = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    const int single = config.producers == 1 && config.consumers == 1;
+    if (config.producers < 1 || config.producers > MAX_PRODUCERS || config.consumers < 1 ||
+        config.size < 1 || config.messages < 1 || config.batch < 1 || config.spinLimit < 0 ||
+        (config.mode == BUFFER_SPSC && !single))
+        usage();
+
+    printf("mode,producers,consumers,size,batch,messages,msgs_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    for (int mode = BUFFER_LOCKED; mode <= BUFFER_MPMC; ++mode)
+    {
+        if (config.mode != -1 && config.mode != mode)
+            continue;
+        if (mode == BUFFER_SPSC && !single)
+            continue;
+        benchOne((enum BufferMode)mode, &config);
+    }
+    return 0;
+}
+
+struct RecordArg
+{
+    struct Buffer *b;
+    long records;
+    long bytes;
+};
+
+// record i is len bytes of "record i" padded with dots, without a
+// terminator, the number is cut short if it does not fit
+#define RECORD_MAX_LEN 63
+
+static int recordLength(long i)
+{
+    return 16 + (int)(i % (RECORD_MAX_LEN - 15));
+}
+
+static void formatRecord(char *dst, int len, long i)
+{
+    char text[32];
+    int written = snprintf(text, sizeof(text), "record %ld", i);
+    if (written > len)
+        written = len;
+    memcpy(dst, text, written);
+    memset(dst + written, '.', len - written);
+}
+
+// serializes variable length messages straight into the ring
+void *recordProducer(void *param)
+{
+    struct RecordArg *arg = (struct RecordArg *)param;
+    for (long i = 0; i < arg->records; ++i)
+    {
+        int len = recordLength(i);
+        char *payload = reserve(arg->b, len);
+        if (payload == NULL)
+            exit(-1);
+        formatRecord(payload, len, i);
+        commit(arg->b);
+        arg->bytes += len;
+    }
+    return NULL;
+}
+
+void *recordConsumer(void *param)
+{
+    struct RecordArg *arg = (struct RecordArg *)param;
+    for (long i = 0; i < arg->records; ++i)
+    {
+        int len;
+        const char *payload = peek(arg->b, &len);
+        char expected[64];
+        formatRecord(expected, recordLength(i), i);
+        if (len != recordLength(i) || memcmp(payload, expected, len) != 0)
+        {
+            fprintf(stderr, "corrupt record %ld\n", i);
+            exit(-1);
+        }
+        arg->bytes += len;
+        release(arg->b);
+    }
+    return NULL;
+}
+
+// one producer, one consumer exchanging length prefixed records without copies
+int records(long count, int size)
+{
+    pthread_t producer, consumer;
+
+    struct Buffer b;
+    initBuffer(&b, size, BUFFER_SPSC, SPIN_LIMIT);
+    if (b.mask + 1 < recordSize(RECORD_MAX_LEN))
+    {
+        fprintf(stderr, "usage: ./main records [count] [size], size of at least %zu\n",
+                recordSize(RECORD_MAX_LEN));
+        destroyBuffer(&b);
+        return -1;
+    }
+
+    struct RecordArg produced = {&b, count, 0};
+    struct RecordArg consumed = {&b, count, 0};
+
+    double start = nowSeconds();
+    pthread_create(&producer, NULL, recordProducer, &produced);
+    pthread_create(&consumer, NULL, recordConsumer, &consumed);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    double elapsed = nowSeconds() - start;
+
+    printf("records: %.0f records/sec, %.0f payload bytes/sec\n", count / elapsed, consumed.bytes / elapsed);
+
+    destroyBuffer(&b);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
-    UNUSED(argc);
-    UNUSED(argv);
+    // ./main bench [options], see usage
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return bench(argc - 1, argv + 1);
+
+    // ./main records [count] [size]
+    if (argc > 1 && strcmp(argv[1], "records") == 0)
+    {
+        long count = argc > 2 ? atol(argv[2]) : 10000000;
+        int size = argc > 3 ? atoi(argv[3]) : 4096;
+        return records(count, size);
+    }
 
     pthread_t producer, consumer;
 
     srand(time(NULL));
 
     struct Buffer b;
-    initBuffer(&b, 10);
+    initBuffer(&b, 10, BUFFER_LOCKED, SPIN_LIMIT);
 
     pthread_create(&producer, NULL, producerFunc, &b);
     pthread_create(&consumer, NULL, consumerFunc, &b);
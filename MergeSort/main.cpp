@@ -1,104 +1,1183 @@
 #include "main.hpp"
 
-void merge(int *arr, int start, int mid, int end)
+namespace
 {
-    int *temp = new int[end - start + 1];
-    int i = start, j = mid + 1, k = 0;
+    // which pool the current thread works for and which queue is its own
+    thread_local const ThreadPool *currentPool = nullptr;
+    thread_local unsigned currentIndex = 0;
+}
+
+ThreadPool::ThreadPool(unsigned threads) : queued(0), stopping(false)
+{
+    unsigned numberOfWorkers = threads > 1 ? threads - 1 : 0;
+
+    for (unsigned i = 0; i <= numberOfWorkers; i++)
+        queues.push_back(std::make_unique<Queue>());
+
+    for (unsigned i = 0; i < numberOfWorkers; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(sleepMtx);
+        stopping = true;
+    }
+    sleepCv.notify_all();
+
+    for (auto &worker : workers)
+        worker.join();
+}
+
+unsigned ThreadPool::currentQueue() const
+{
+    if (currentPool == this)
+        return currentIndex;
+    return static_cast<unsigned>(queues.size() - 1);
+}
+
+void ThreadPool::fork(TaskGroup &group, std::function<void()> fn)
+{
+    group.pending.fetch_add(1, std::memory_order_relaxed);
+
+    Queue &queue = *queues[currentQueue()];
+    {
+        std::unique_lock<std::mutex> lock(queue.mtx);
+        queue.tasks.push_back(Task{std::move(fn), &group});
+    }
+    queued.fetch_add(1);
+
+    // taking the lock orders us against a worker between its check and its wait
+    {
+        std::unique_lock<std::mutex> lock(sleepMtx);
+    }
+    sleepCv.notify_one();
+}
+
+bool ThreadPool::tryRun(unsigned index)
+{
+    Task task;
+    bool found = false;
+
+    {
+        Queue &own = *queues[index];
+        std::unique_lock<std::mutex> lock(own.mtx);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    for (size_t i = 1; !found && i < queues.size(); i++)
+    {
+        Queue &victim = *queues[(index + i) % queues.size()];
+        std::unique_lock<std::mutex> lock(victim.mtx);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found)
+        return false;
+
+    queued.fetch_sub(1);
+    task.fn();
+    task.group->pending.fetch_sub(1, std::memory_order_release);
+    return true;
+}
+
+void ThreadPool::join(TaskGroup &group)
+{
+    const unsigned index = currentQueue();
+    while (group.pending.load(std::memory_order_acquire) > 0)
+    {
+        if (!tryRun(index))
+            std::this_thread::yield();
+    }
+}
+
+void ThreadPool::workerLoop(unsigned index)
+{
+    currentPool = this;
+    currentIndex = index;
+
+    while (true)
+    {
+        if (tryRun(index))
+            continue;
+
+        std::unique_lock<std::mutex> lock(sleepMtx);
+        sleepCv.wait(lock, [this]
+                     { return stopping || queued.load() > 0; });
+        if (stopping)
+            return;
+    }
+}
+
+// merges the sorted runs a[0..na) and b[0..nb) into out, a wins ties
+void mergeRunsScalar(const int *a, std::size_t na, const int *b, std::size_t nb, int *out)
+{
+    std::size_t i = 0, j = 0, k = 0;
+
+    while (i < na && j < nb)
+    {
+        if (a[i] <= b[j])
+            out[k++] = a[i++];
+        else
+            out[k++] = b[j++];
+    }
+
+    while (i < na)
+        out[k++] = a[i++];
+
+    while (j < nb)
+        out[k++] = b[j++];
+}
+
+// insertion sort, the fallback base case for at most SMALL_SORT elements
+void sortSmallScalar(int *arr, std::size_t n)
+{
+    insertionSort(arr, n, std::less<int>());
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define AVX2 __attribute__((target("avx2")))
+
+namespace
+{
+    AVX2 inline __m256i reverse8(__m256i v)
+    {
+        return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    }
+
+    // sorts a bitonic vector: half cleaners at distance 4, 2 and 1
+    AVX2 inline __m256i cleanBitonic8(__m256i v)
+    {
+        __m256i t = _mm256_permute2x128_si256(v, v, 0x01);
+        v = _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xF0);
+        t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+        v = _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xCC);
+        t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xAA);
+        return v;
+    }
+
+    // sorts count vectors holding one bitonic sequence
+    AVX2 inline void cleanBitonic(__m256i *v, int count)
+    {
+        for (int distance = count / 2; distance > 0; distance /= 2)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                if (i & distance)
+                    continue;
+                __m256i low = _mm256_min_epi32(v[i], v[i + distance]);
+                v[i + distance] = _mm256_max_epi32(v[i], v[i + distance]);
+                v[i] = low;
+            }
+        }
+        for (int i = 0; i < count; i++)
+            v[i] = cleanBitonic8(v[i]);
+    }
+
+    // a and b each hold a sorted run of count vectors. Afterwards a holds the
+    // smaller half of both, b the larger one, both sorted.
+    AVX2 inline void mergeBitonic(__m256i *a, __m256i *b, int count)
+    {
+        for (int i = 0; i < count / 2; i++)
+        {
+            __m256i t = b[i];
+            b[i] = b[count - 1 - i];
+            b[count - 1 - i] = t;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            b[i] = reverse8(b[i]);
+            __m256i low = _mm256_min_epi32(a[i], b[i]);
+            b[i] = _mm256_max_epi32(a[i], b[i]);
+            a[i] = low;
+        }
+        cleanBitonic(a, count);
+        cleanBitonic(b, count);
+    }
+
+    AVX2 inline void compareExchange(__m256i &a, __m256i &b)
+    {
+        __m256i low = _mm256_min_epi32(a, b);
+        b = _mm256_max_epi32(a, b);
+        a = low;
+    }
+
+    AVX2 inline void transpose8(__m256i *r)
+    {
+        __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+        __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+        __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+        __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+        __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+        __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+        __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+        __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+        __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+        __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+        __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+        __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+        __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+        __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+        __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+        __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+        r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+        r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+        r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+        r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+        r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+        r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+        r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+        r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+    }
+
+    // three way tail of mergeRunsAvx2, all inputs sorted
+    void mergeTail(const int *c, std::size_t nc, const int *a, std::size_t na, const int *b, std::size_t nb, int *out)
+    {
+        std::size_t i = 0, j = 0, k = 0;
+        while (k < nc)
+        {
+            if ((i == na || c[k] <= a[i]) && (j == nb || c[k] <= b[j]))
+                *out++ = c[k++];
+            else if (j == nb || (i < na && a[i] <= b[j]))
+                *out++ = a[i++];
+            else
+                *out++ = b[j++];
+        }
+        mergeRunsScalar(a + i, na - i, b + j, nb - j, out);
+    }
+}
+
+// Sorts up to SMALL_SORT ints: a sorting network over 8 vectors sorts the
+// columns of an 8x8 block, a transpose turns them into 8 sorted runs and three
+// rounds of in-register bitonic merges join them. Longer inputs do not fit the
+// block and are handed to std::sort.
+AVX2 void sortSmallAvx2(int *arr, std::size_t n)
+{
+    if (n > SMALL_SORT)
+    {
+        std::sort(arr, arr + n);
+        return;
+    }
 
-    while (i <= mid && j <= end)
+    alignas(32) int block[SMALL_SORT];
+    std::copy(arr, arr + n, block);
+    std::fill(block + n, block + SMALL_SORT, std::numeric_limits<int>::max());
+
+    __m256i r[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = _mm256_load_si256(reinterpret_cast<const __m256i *>(block + 8 * i));
+
+    // optimal 19 comparator network for 8 inputs
+    compareExchange(r[0], r[2]);
+    compareExchange(r[1], r[3]);
+    compareExchange(r[4], r[6]);
+    compareExchange(r[5], r[7]);
+    compareExchange(r[0], r[4]);
+    compareExchange(r[1], r[5]);
+    compareExchange(r[2], r[6]);
+    compareExchange(r[3], r[7]);
+    compareExchange(r[0], r[1]);
+    compareExchange(r[2], r[3]);
+    compareExchange(r[4], r[5]);
+    compareExchange(r[6], r[7]);
+    compareExchange(r[2], r[4]);
+    compareExchange(r[3], r[5]);
+    compareExchange(r[1], r[4]);
+    compareExchange(r[3], r[6]);
+    compareExchange(r[1], r[2]);
+    compareExchange(r[3], r[4]);
+    compareExchange(r[5], r[6]);
+
+    transpose8(r);
+
+    for (int i = 0; i < 8; i += 2)
+        mergeBitonic(r + i, r + i + 1, 1);
+    mergeBitonic(r, r + 2, 2);
+    mergeBitonic(r + 4, r + 6, 2);
+    mergeBitonic(r, r + 4, 4);
+
+    for (int i = 0; i < 8; i++)
+        _mm256_store_si256(reinterpret_cast<__m256i *>(block + 8 * i), r[i]);
+    std::copy(block, block + n, arr);
+}
+
+// Merges 8 elements per step: the bitonic merge of the two current vectors
+// emits the smaller 8 and keeps the larger 8, which are merged next with the
+// vector of whichever run has the smaller head.
+AVX2 void mergeRunsAvx2(const int *a, std::size_t na, const int *b, std::size_t nb, int *out)
+{
+    if (na < 8 || nb < 8)
     {
-        if (arr[i] <= arr[j])
-            temp[k++] = arr[i++];
+        mergeRunsScalar(a, na, b, nb, out);
+        return;
+    }
+
+    __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+    __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+    std::size_t i = 8, j = 8;
+
+    while (true)
+    {
+        mergeBitonic(&low, &high, 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), low);
+        out += 8;
+
+        // the run with the smaller head has to go next, the scalar tail takes
+        // over once that run has less than a full vector left
+        const bool takeA = j == nb || (i < na && a[i] <= b[j]);
+        if (takeA && i + 8 <= na)
+        {
+            low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+            i += 8;
+        }
+        else if (!takeA && j + 8 <= nb)
+        {
+            low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j));
+            j += 8;
+        }
         else
-            temp[k++] = arr[j++];
+        {
+            break;
+        }
+    }
+
+    alignas(32) int rest[8];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(rest), high);
+    mergeTail(rest, 8, a + i, na - i, b + j, nb - j, out);
+}
+
+#undef AVX2
+
+#endif
+
+namespace
+{
+    struct Kernels
+    {
+        void (*sortSmall)(int *, std::size_t);
+        void (*mergeRuns)(const int *, std::size_t, const int *, std::size_t, int *);
+    };
+
+    Kernels pickKernels()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2"))
+            return Kernels{sortSmallAvx2, mergeRunsAvx2};
+#endif
+        return Kernels{sortSmallScalar, mergeRunsScalar};
     }
 
-    while (i <= mid)
-        temp[k++] = arr[i++];
+    // picked once by cpu feature
+    const Kernels kernels = pickKernels();
+}
 
-    while (j <= end)
-        temp[k++] = arr[j++];
+void sortSmall(int *arr, std::size_t n)
+{
+    kernels.sortSmall(arr, n);
+}
 
-    for (i = start; i <= end; i++)
-        arr[i] = temp[i - start];
+void mergeRuns(const int *a, std::size_t na, const int *b, std::size_t nb, int *out)
+{
+    kernels.mergeRuns(a, na, b, nb, out);
+}
 
-    delete[] temp;
+ThreadPool &defaultPool()
+{
+    static ThreadPool pool;
+    return pool;
 }
 
-void sortAndMerge(int *arr, int start, int mid, int end, int lowerLimit, int freeLogicalCores, std::shared_ptr<std::mutex> mtx)
+// sorts arr[start..end], both inclusive
+void mergeSort(int *arr, int start, int end, int lowerLimit, ThreadPool &pool)
 {
-    mergeSort(arr, start, mid, lowerLimit, freeLogicalCores, mtx);
-    mergeSort(arr, mid + 1, end, lowerLimit, freeLogicalCores, mtx);
-    merge(arr, start, mid, end);
-};
+    if (start >= end)
+        return;
+
+    parallelMergeSort(arr + start, arr + end + 1, std::less<int>(), pool, static_cast<std::size_t>(lowerLimit));
+}
 
-void mergeSort(int *arr, int start, int end, int lowerLimit, int freeLogicalCores, std::shared_ptr<std::mutex> mtx)
+namespace
 {
-    if (start < end)
+    // Every run being merged gets a read buffer of at least this size. With
+    // more runs than the budget allows, groups of them are merged first.
+    constexpr std::size_t MIN_RUN_BUFFER = 1 << 20;
+
+    [[noreturn]] void throwErrno(const std::string &what)
+    {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    // owns a file descriptor
+    class File
+    {
+    public:
+        explicit File(int fd) : fd(fd) {}
+        File(File &&other) noexcept : fd(other.fd) { other.fd = -1; }
+        File(const File &) = delete;
+        File &operator=(const File &) = delete;
+        File &operator=(File &&) = delete;
+        ~File()
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+
+        int get() const { return fd; }
+
+    private:
+        int fd;
+    };
+
+    // owns a mapping
+    class Mapping
+    {
+    public:
+        Mapping(int fd, off_t offset, std::size_t bytes) : bytes(bytes)
+        {
+            // private and writable, so the chunk is sorted in place without
+            // touching the input file
+            addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+            if (addr == MAP_FAILED)
+                throwErrno("mmap");
+            madvise(addr, bytes, MADV_WILLNEED);
+        }
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+        ~Mapping() { munmap(addr, bytes); }
+
+        void *get() const { return addr; }
+
+    private:
+        void *addr;
+        std::size_t bytes;
+    };
+
+    // the file is unlinked right away, so runs vanish even if we crash
+    File openTemp(const std::string &dir)
+    {
+        std::string path = dir + "/mergesort-XXXXXX";
+        File file(mkstemp(&path[0]));
+        if (file.get() < 0)
+            throwErrno(path);
+        unlink(path.c_str());
+        return file;
+    }
+
+    // descriptors the process may still open under RLIMIT_NOFILE
+    std::size_t freeDescriptors()
+    {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+            return std::numeric_limits<std::size_t>::max();
+
+        std::size_t used = 0;
+        for (rlim_t fd = 0; fd < limit.rlim_cur; fd++)
+            if (fcntl(static_cast<int>(fd), F_GETFD) != -1)
+                used++;
+        return limit.rlim_cur > used ? static_cast<std::size_t>(limit.rlim_cur - used) : 0;
+    }
+
+    void writeAll(int fd, const void *data, std::size_t bytes)
+    {
+        const char *p = static_cast<const char *>(data);
+        while (bytes > 0)
+        {
+            ssize_t written = write(fd, p, bytes);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throwErrno("write");
+            }
+            p += written;
+            bytes -= static_cast<std::size_t>(written);
+        }
+    }
+
+    // Reads a sorted run block by block from the front. After every block the
+    // kernel is asked to start reading the next one, so the disk works while
+    // the merge consumes this one.
+    template <class T>
+    class RunReader
     {
-        int mid = (start + end) / 2;
+    public:
+        RunReader(int fd, std::size_t elements) : fd(fd), offset(0), buffer(elements), pos(0), len(0)
+        {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            refill();
+        }
 
-        if (end - start > lowerLimit)
+        bool empty() const { return pos == len; }
+        const T &head() const { return buffer[pos]; }
+
+        void pop()
         {
-            bool spawnThread = false;
+            if (++pos == len)
+                refill();
+        }
+
+    private:
+        void refill()
+        {
+            const std::size_t bytes = buffer.size() * sizeof(T);
+            std::size_t got = 0;
+            while (got < bytes)
             {
-                std::unique_lock<std::mutex> lock(*mtx);
-                if (freeLogicalCores > 0)
+                ssize_t n = pread(fd, reinterpret_cast<char *>(buffer.data()) + got, bytes - got, offset + got);
+                if (n < 0)
                 {
-                    freeLogicalCores--;
-                    spawnThread = true;
+                    if (errno == EINTR)
+                        continue;
+                    throwErrno("read");
                 }
+                if (n == 0)
+                    break;
+                got += static_cast<std::size_t>(n);
             }
 
-            if (spawnThread)
+            offset += got;
+            pos = 0;
+            len = got / sizeof(T);
+            if (len > 0)
+                posix_fadvise(fd, offset, bytes, POSIX_FADV_WILLNEED);
+        }
+
+        int fd;
+        off_t offset;
+        std::vector<T> buffer;
+        std::size_t pos;
+        std::size_t len;
+    };
+
+    // Tournament over k runs. Every inner node keeps the loser of its match
+    // and tree[0] the overall winner, so replacing the winner only replays the
+    // matches on the path from its leaf to the root: log k comparisons per key.
+    template <class T>
+    class LoserTree
+    {
+    public:
+        explicit LoserTree(std::vector<RunReader<T>> &runs) : runs(runs), k(runs.size()), tree(std::max<std::size_t>(k, 1))
+        {
+            // leaves are k + i, node i plays the winners of 2i and 2i + 1
+            std::vector<std::size_t> winner(2 * k);
+            for (std::size_t i = 0; i < k; i++)
+                winner[k + i] = i;
+            for (std::size_t i = k - 1; i > 0; i--)
             {
-                std::thread lovelyThread(mergeSort, arr, start, mid, lowerLimit, freeLogicalCores, mtx);
-                mergeSort(arr, mid + 1, end, lowerLimit, freeLogicalCores, mtx);
+                std::size_t a = winner[2 * i];
+                std::size_t b = winner[2 * i + 1];
+                winner[i] = beats(b, a) ? b : a;
+                tree[i] = beats(b, a) ? a : b;
+            }
+            tree[0] = k > 1 ? winner[1] : 0;
+        }
 
-                lovelyThread.join();
-                {
-                    std::unique_lock<std::mutex> lock(*mtx);
-                    freeLogicalCores++;
-                }
+        bool empty() const { return runs[tree[0]].empty(); }
+        const T &top() const { return runs[tree[0]].head(); }
 
-                merge(arr, start, mid, end);
-                return;
+        void pop()
+        {
+            std::size_t winner = tree[0];
+            runs[winner].pop();
+            for (std::size_t node = (winner + k) / 2; node > 0; node /= 2)
+            {
+                if (beats(tree[node], winner))
+                    std::swap(tree[node], winner);
             }
+            tree[0] = winner;
+        }
 
-            sortAndMerge(arr, start, mid, end, lowerLimit, freeLogicalCores, mtx);
-            return;
+    private:
+        // exhausted runs lose every match, ties go to the earlier run
+        bool beats(std::size_t a, std::size_t b) const
+        {
+            if (runs[a].empty())
+                return false;
+            if (runs[b].empty())
+                return true;
+            if (runs[a].head() < runs[b].head())
+                return true;
+            if (runs[b].head() < runs[a].head())
+                return false;
+            return a < b;
+        }
+
+        std::vector<RunReader<T>> &runs;
+        std::size_t k;
+        std::vector<std::size_t> tree;
+    };
+
+    // merges the runs [first, last) into fd, budget split over all buffers
+    template <class T>
+    void mergeRunFiles(std::vector<File>::const_iterator first, std::vector<File>::const_iterator last, int fd,
+                       std::size_t memoryBudget)
+    {
+        const std::size_t k = static_cast<std::size_t>(last - first);
+        const std::size_t elements = std::max<std::size_t>(memoryBudget / (k + 1) / sizeof(T), 1024);
+
+        std::vector<RunReader<T>> readers;
+        readers.reserve(k);
+        for (auto it = first; it != last; ++it)
+            readers.emplace_back(it->get(), elements);
+
+        LoserTree<T> tree(readers);
+        std::vector<T> out;
+        out.reserve(elements);
+        while (!tree.empty())
+        {
+            out.push_back(tree.top());
+            tree.pop();
+            if (out.size() == elements)
+            {
+                writeAll(fd, out.data(), out.size() * sizeof(T));
+                out.clear();
+            }
+        }
+        writeAll(fd, out.data(), out.size() * sizeof(T));
+    }
+
+    // merges every fanIn runs into one, closing each group once it is merged,
+    // so a pass never has more than one descriptor open beyond runs
+    template <class T>
+    std::vector<File> mergePass(std::vector<File> &runs, std::size_t fanIn, const ExternalSortOptions &options)
+    {
+        std::vector<File> merged;
+        for (std::size_t i = 0; i < runs.size(); i += fanIn)
+        {
+            const std::size_t count = std::min(fanIn, runs.size() - i);
+            std::vector<File> group(std::make_move_iterator(runs.begin() + i),
+                                    std::make_move_iterator(runs.begin() + i + count));
+            merged.push_back(openTemp(options.tempDir));
+            mergeRunFiles<T>(group.cbegin(), group.cend(), merged.back().get(), options.memoryBudget);
+        }
+        return merged;
+    }
+
+    template <class T>
+    void externalSortKeys(const char *input, const char *output, const ExternalSortOptions &options, ThreadPool &pool)
+    {
+        // runs stay open until merged, and a merge pass needs one more for
+        // its output. Input and output take two.
+        const std::size_t descriptors = freeDescriptors();
+        if (descriptors < 5)
+            throw std::system_error(EMFILE, std::generic_category(), "not enough file descriptors for runs");
+        const std::size_t maxRuns = descriptors - 3;
+
+        // more runs than buffers fit into the budget or descriptors allow are
+        // merged in groups into longer runs first
+        const std::size_t fanIn = std::min(std::max<std::size_t>(options.memoryBudget / MIN_RUN_BUFFER, 3) - 1,
+                                           maxRuns);
+
+        File in(open(input, O_RDONLY));
+        if (in.get() < 0)
+            throwErrno(input);
+
+        struct stat st;
+        if (fstat(in.get(), &st) < 0)
+            throwErrno(input);
+        if (st.st_size % sizeof(T) != 0)
+            throw std::system_error(EINVAL, std::generic_category(), std::string(input) + ": not a whole number of keys");
+        const std::size_t total = static_cast<std::size_t>(st.st_size) / sizeof(T);
+
+        File out(open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (out.get() < 0)
+            throwErrno(output);
+
+        // parallelMergeSort needs as much scratch as the chunk, and chunks
+        // start on page boundaries so they can be mapped
+        const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        const std::size_t chunkBytes = std::max(options.memoryBudget / 2 / page * page, page);
+        const std::size_t chunk = chunkBytes / sizeof(T);
+
+        // run generation: sort every chunk with all threads and write it out
+        std::vector<File> runs;
+        for (std::size_t start = 0; start < total; start += chunk)
+        {
+            const std::size_t n = std::min(chunk, total - start);
+            const off_t offset = static_cast<off_t>(start * sizeof(T));
+
+            Mapping map(in.get(), offset, n * sizeof(T));
+            // read ahead into the next chunk while this one sorts
+            if (start + n < total)
+                posix_fadvise(in.get(), offset + static_cast<off_t>(n * sizeof(T)), chunkBytes, POSIX_FADV_WILLNEED);
+
+            T *keys = static_cast<T *>(map.get());
+            parallelMergeSort(keys, keys + n, std::less<T>(), pool);
+
+            // a single chunk is the result already
+            if (n == total)
+            {
+                writeAll(out.get(), keys, n * sizeof(T));
+                return;
+            }
+            // out of descriptors: merge what is there before the next run
+            if (runs.size() == maxRuns)
+                runs = mergePass<T>(runs, fanIn, options);
+            runs.push_back(openTemp(options.tempDir));
+            writeAll(runs.back().get(), keys, n * sizeof(T));
         }
 
-        sortAndMerge(arr, start, mid, end, lowerLimit, freeLogicalCores, mtx);
+        while (runs.size() > fanIn)
+            runs = mergePass<T>(runs, fanIn, options);
+
+        if (!runs.empty())
+            mergeRunFiles<T>(runs.cbegin(), runs.cend(), out.get(), options.memoryBudget);
     }
 }
 
-void randomizeArray(int *arr, int n)
+void externalSort(const char *input, const char *output, const ExternalSortOptions &options, ThreadPool &pool)
+{
+    if (options.keyBytes == 8)
+        externalSortKeys<std::int64_t>(input, output, options, pool);
+    else
+        externalSortKeys<std::int32_t>(input, output, options, pool);
+}
+
+void randomizeArray(int *arr, std::size_t n)
 {
     srand(time(NULL));
-    for (int i = 0; i < n; i++)
+    for (std::size_t i = 0; i < n; i++)
         arr[i] = rand() % 1000;
 }
 
-void printArray(int *arr, int n)
+void printArray(int *arr, std::size_t n)
 {
-    for (int i = 0; i < n; i++)
+    for (std::size_t i = 0; i < n; i++)
         std::cout << arr[i] << " ";
     std::cout << std::endl;
 }
 
-int main()
+bool isSorted(int *arr, std::size_t n)
+{
+    for (std::size_t i = 1; i < n; i++)
+        if (arr[i - 1] > arr[i])
+            return false;
+    return true;
+}
+
+static void usage()
+{
+    std::cerr << "usage: ./main [numberOfElements] [lowerLimit] [auto|merge|adaptive|radix|counting|argsort]\n"
+                 "       ./main genfile <output> <count> [-w 4|8]\n"
+                 "       ./main extsort <input> <output> [-w 4|8] [-T tempDir] [-m memoryMiB]\n"
+                 "       ./main bench [options], see ./main bench -h\n";
+    exit(-1);
+}
+
+// writes count random keys of the given width to path
+template <class T>
+static void generateFile(const char *path, std::size_t count)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::system_error(errno, std::generic_category(), path);
+
+    std::mt19937_64 rng(std::random_device{}());
+    std::vector<T> block(1 << 20);
+    for (std::size_t done = 0; done < count; done += block.size())
+    {
+        const std::size_t n = std::min(block.size(), count - done);
+        for (std::size_t i = 0; i < n; i++)
+            block[i] = static_cast<T>(rng());
+        out.write(reinterpret_cast<const char *>(block.data()), static_cast<std::streamsize>(n * sizeof(T)));
+    }
+    if (!out.flush())
+        throw std::system_error(errno, std::generic_category(), path);
+}
+
+template <class T>
+static bool isSortedFile(const char *path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::vector<T> block(1 << 20);
+    bool first = true;
+    T last = 0;
+    while (in)
+    {
+        in.read(reinterpret_cast<char *>(block.data()), static_cast<std::streamsize>(block.size() * sizeof(T)));
+        const std::size_t n = static_cast<std::size_t>(in.gcount()) / sizeof(T);
+        if (n == 0)
+            break;
+        if ((!first && block[0] < last) || !std::is_sorted(block.begin(), block.begin() + n))
+            return false;
+        first = false;
+        last = block[n - 1];
+    }
+    return true;
+}
+
+// parses -w, -T and -m behind the positional arguments
+static ExternalSortOptions parseFileOptions(int argc, char **argv)
+{
+    ExternalSortOptions options;
+    if (const char *tmp = std::getenv("TMPDIR"))
+        options.tempDir = tmp;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:T:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            options.keyBytes = atoi(optarg);
+            if (options.keyBytes != 4 && options.keyBytes != 8)
+                usage();
+            break;
+        case 'T':
+            options.tempDir = optarg;
+            break;
+        case 'm':
+            options.memoryBudget = std::strtoull(optarg, nullptr, 10) << 20;
+            if (options.memoryBudget == 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    return options;
+}
+
+static int genfile(int argc, char **argv)
+{
+    if (argc < 3)
+        usage();
+    const char *path = argv[1];
+    std::size_t count = std::strtoull(argv[2], nullptr, 10);
+    ExternalSortOptions options = parseFileOptions(argc - 2, argv + 2);
+
+    if (options.keyBytes == 8)
+        generateFile<std::int64_t>(path, count);
+    else
+        generateFile<std::int32_t>(path, count);
+    return 0;
+}
+
+static int extsort(int argc, char **argv)
+{
+    if (argc < 3)
+        usage();
+    const char *input = argv[1];
+    const char *output = argv[2];
+    ExternalSortOptions options = parseFileOptions(argc - 2, argv + 2);
+
+    ThreadPool &pool = defaultPool();
+    auto begin = std::chrono::steady_clock::now();
+    externalSort(input, output, options, pool);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+    bool sorted = options.keyBytes == 8 ? isSortedFile<std::int64_t>(output) : isSortedFile<std::int32_t>(output);
+    std::cout << input << " -> " << output << " with " << (options.memoryBudget >> 20) << " MiB on "
+              << pool.size() << " threads: " << elapsed.count() << " s, " << (sorted ? "sorted" : "NOT SORTED")
+              << std::endl;
+    return sorted ? 0 : 1;
+}
+
+// splits "a,b,c" into its items
+static std::vector<std::string> splitList(const char *list)
+{
+    std::vector<std::string> items;
+    std::string item;
+    for (const char *p = list;; p++)
+    {
+        if (*p == ',' || *p == '\0')
+        {
+            if (!item.empty())
+                items.push_back(item);
+            item.clear();
+            if (*p == '\0')
+                return items;
+        }
+        else
+            item += *p;
+    }
+}
+
+static std::vector<std::size_t> splitNumbers(const char *list)
+{
+    std::vector<std::size_t> numbers;
+    for (const std::string &item : splitList(list))
+        numbers.push_back(std::strtoull(item.c_str(), nullptr, 10));
+    return numbers;
+}
+
+// fills arr with n keys of the named distribution, false if it is unknown
+static bool fillDistribution(const std::string &distribution, std::vector<int> &arr, std::size_t n, std::mt19937 &rng)
+{
+    arr.resize(n);
+    if (distribution == "uniform")
+    {
+        for (auto &x : arr)
+            x = static_cast<int>(rng());
+    }
+    else if (distribution == "sorted")
+    {
+        for (std::size_t i = 0; i < n; i++)
+            arr[i] = static_cast<int>(i);
+    }
+    else if (distribution == "reverse")
+    {
+        for (std::size_t i = 0; i < n; i++)
+            arr[i] = static_cast<int>(n - i);
+    }
+    else if (distribution == "fewunique")
+    {
+        for (auto &x : arr)
+            x = static_cast<int>(rng() % 16);
+    }
+    else if (distribution == "zipf")
+    {
+        // rank r of 2^16 values is drawn with probability proportional to 1 / r
+        std::vector<double> cdf(1 << 16);
+        double sum = 0;
+        for (std::size_t r = 0; r < cdf.size(); r++)
+            cdf[r] = sum += 1.0 / static_cast<double>(r + 1);
+        std::uniform_real_distribution<double> uniform(0, sum);
+        for (auto &x : arr)
+            x = static_cast<int>(std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin());
+    }
+    else if (distribution == "organpipe")
+    {
+        for (std::size_t i = 0; i < n; i++)
+            arr[i] = static_cast<int>(i < n / 2 ? i : n - i);
+    }
+    else
+        return false;
+    return true;
+}
+
+static void benchUsage()
+{
+    std::cerr << "usage: ./main bench [-s maxSize] [-d distributions] [-a algorithms] [-t threads] [-l lowerLimits] [-r minSeconds]\n"
+                 "  lists are comma separated\n"
+                 "  distributions: uniform,sorted,reverse,fewunique,zipf,organpipe\n"
+                 "  algorithms: merge,adaptive,auto,std::sort,std::stable_sort\n";
+    exit(-1);
+}
+
+// Sweeps sizes 10^3 up to maxSize, distributions, algorithms, thread counts
+// and, for merge, lowerLimit cutoffs. Prints one CSV line per combination to
+// stdout and the cutoff with the best geometric mean throughput per thread
+// count to stderr.
+static int bench(int argc, char **argv)
+{
+    std::size_t maxSize = 100000000;
+    std::vector<std::string> distributions = {"uniform", "sorted", "reverse", "fewunique", "zipf", "organpipe"};
+    std::vector<std::string> algorithms = {"merge", "adaptive", "auto", "std::sort", "std::stable_sort"};
+    std::vector<std::size_t> lowerLimits = {256, 1024, 4096, 16384, 65536};
+    std::vector<std::size_t> threadCounts;
+    double minSeconds = 0.2;
+
+    const unsigned hardware = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned t = 1; t < hardware; t *= 2)
+        threadCounts.push_back(t);
+    threadCounts.push_back(hardware);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:a:t:l:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            maxSize = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'd':
+            distributions = splitList(optarg);
+            break;
+        case 'a':
+            algorithms = splitList(optarg);
+            break;
+        case 't':
+            threadCounts = splitNumbers(optarg);
+            break;
+        case 'l':
+            lowerLimits = splitNumbers(optarg);
+            break;
+        case 'r':
+            minSeconds = atof(optarg);
+            break;
+        default:
+            benchUsage();
+        }
+    }
+    if (threadCounts.empty() || lowerLimits.empty())
+        benchUsage();
+
+    // elements/s of merge per threads and lowerLimit, for the suggestion
+    std::vector<std::vector<double>> logThroughput(threadCounts.size(), std::vector<double>(lowerLimits.size()));
+    std::vector<std::vector<int>> samples(threadCounts.size(), std::vector<int>(lowerLimits.size()));
+
+    std::mt19937 rng(42);
+    std::vector<int> input, arr;
+    std::cout << "algorithm,distribution,size,threads,lower_limit,repetitions,best_s,elements_per_sec" << std::endl;
+
+    for (std::size_t size = 1000; size <= maxSize; size *= 10)
+    {
+        for (const std::string &distribution : distributions)
+        {
+            if (!fillDistribution(distribution, input, size, rng))
+                benchUsage();
+
+            for (std::size_t ti = 0; ti < threadCounts.size(); ti++)
+            {
+                ThreadPool pool(static_cast<unsigned>(threadCounts[ti]));
+
+                for (const std::string &algorithm : algorithms)
+                {
+                    const bool sequential = algorithm == "std::sort" || algorithm == "std::stable_sort";
+                    // std sorts ignore the pool, once is enough
+                    if (sequential && ti > 0)
+                        continue;
+                    const bool sweep = algorithm == "merge";
+
+                    for (std::size_t li = 0; li < (sweep ? lowerLimits.size() : 1); li++)
+                    {
+                        const std::size_t lowerLimit = sweep ? lowerLimits[li] : LOWER_LIMIT;
+
+                        auto sortOnce = [&]
+                        {
+                            arr = input;
+                            auto begin = std::chrono::steady_clock::now();
+                            if (algorithm == "merge")
+                                parallelMergeSort(arr.begin(), arr.end(), std::less<int>(), pool, lowerLimit);
+                            else if (algorithm == "adaptive")
+                                parallelAdaptiveSort(arr.begin(), arr.end(), std::less<int>(), pool);
+                            else if (algorithm == "auto")
+                                parallelSort(arr.begin(), arr.end(), pool);
+                            else if (algorithm == "std::sort")
+                                std::sort(arr.begin(), arr.end());
+                            else if (algorithm == "std::stable_sort")
+                                std::stable_sort(arr.begin(), arr.end());
+                            else
+                                benchUsage();
+                            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+                            if (!std::is_sorted(arr.begin(), arr.end()))
+                            {
+                                std::cerr << algorithm << " did not sort " << distribution << " " << size << std::endl;
+                                exit(1);
+                            }
+                            return elapsed.count();
+                        };
+
+                        // repeat small sizes until minSeconds have passed, keep the best
+                        double best = std::numeric_limits<double>::max();
+                        double total = 0;
+                        int repetitions = 0;
+                        do
+                        {
+                            double seconds = sortOnce();
+                            best = std::min(best, seconds);
+                            total += seconds;
+                            repetitions++;
+                        } while (total < minSeconds && repetitions < 1000);
+
+                        const double throughput = static_cast<double>(size) / best;
+                        std::cout << algorithm << "," << distribution << "," << size << ","
+                                  << (sequential ? 1 : threadCounts[ti]) << "," << (sweep ? lowerLimit : 0) << ","
+                                  << repetitions << "," << best << "," << throughput << std::endl;
+
+                        // below this the cutoff hardly forks anything
+                        if (sweep && size >= 100000)
+                        {
+                            logThroughput[ti][li] += std::log(throughput);
+                            samples[ti][li]++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for (std::size_t ti = 0; ti < threadCounts.size(); ti++)
+    {
+        std::size_t best = 0;
+        for (std::size_t li = 0; li < lowerLimits.size(); li++)
+            if (samples[ti][li] > 0 && logThroughput[ti][li] / samples[ti][li] > logThroughput[ti][best] / std::max(samples[ti][best], 1))
+                best = li;
+        if (samples[ti][best] > 0)
+            std::cerr << "# suggested lowerLimit for " << threadCounts[ti] << " threads: " << lowerLimits[best]
+                      << " (" << std::exp(logThroughput[ti][best] / samples[ti][best]) << " elements/s geometric mean)"
+                      << std::endl;
+    }
+
+    return 0;
+}
+
+// ./main [numberOfElements] [lowerLimit] [algorithm], or another mode, see usage
+int main(int argc, char **argv)
 {
-    int freeLogicalCores = std::thread::hardware_concurrency();
-    std::shared_ptr<std::mutex> mtx = std::make_shared<std::mutex>();
+    try
+    {
+        if (argc > 1 && std::strcmp(argv[1], "bench") == 0)
+            return bench(argc - 1, argv + 1);
+        if (argc > 1 && std::strcmp(argv[1], "genfile") == 0)
+            return genfile(argc - 1, argv + 1);
+        if (argc > 1 && std::strcmp(argv[1], "extsort") == 0)
+            return extsort(argc - 1, argv + 1);
+    }
+    catch (const std::system_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
 
-    int numberOfElements = 1000;
-    int lowerLimit = 100;
+    ThreadPool &pool = defaultPool();
+
+    std::size_t numberOfElements = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000;
+    std::size_t lowerLimit = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100;
+    const char *algorithm = argc > 3 ? argv[3] : "merge";
 
     int *arr = new int[numberOfElements];
     randomizeArray(arr, numberOfElements);
-    mergeSort(arr, 0, numberOfElements, lowerLimit, freeLogicalCores, mtx);
-    printArray(arr, numberOfElements);
+
+    auto begin = std::chrono::steady_clock::now();
+    if (std::strcmp(algorithm, "auto") == 0)
+        parallelSort(arr, arr + numberOfElements, pool);
+    else if (std::strcmp(algorithm, "radix") == 0)
+        parallelRadixSort(arr, arr + numberOfElements, pool);
+    else if (std::strcmp(algorithm, "counting") == 0)
+    {
+        if (!parallelCountingSort(arr, arr + numberOfElements, pool))
+            usage();
+    }
+    else if (std::strcmp(algorithm, "adaptive") == 0)
+        parallelAdaptiveSort(arr, arr + numberOfElements, std::less<int>(), pool);
+    else if (std::strcmp(algorithm, "argsort") == 0)
+    {
+        std::vector<std::size_t> perm = parallelArgsort(arr, arr + numberOfElements, std::less<int>(), pool);
+        std::vector<int> sorted(numberOfElements);
+        for (std::size_t i = 0; i < numberOfElements; i++)
+            sorted[i] = arr[perm[i]];
+        std::copy(sorted.begin(), sorted.end(), arr);
+    }
+    else if (std::strcmp(algorithm, "merge") == 0)
+        parallelMergeSort(arr, arr + numberOfElements, std::less<int>(), pool, lowerLimit);
+    else
+        usage();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+    if (numberOfElements <= 1000)
+        printArray(arr, numberOfElements);
+    else
+        std::cout << numberOfElements << " elements, " << algorithm << " on " << pool.size() << " threads: "
+                  << elapsed.count() << " s, " << (isSorted(arr, numberOfElements) ? "sorted" : "NOT SORTED")
+                  << std::endl;
     delete[] arr;
 
     return 0;
@@ -5,9 +5,1018 @@
 #include <shared_mutex>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <utility>
+#include <iterator>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <random>
+#include <fstream>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
-void merge(int *arr, int start, int mid, int end);
-void sortAndMerge(int *arr, int start, int mid, int end, int lowerLimit, int freeLogicalCores, std::shared_ptr<std::mutex> mtx);
-void mergeSort(int *arr, int start, int end, int lowerLimit, int freeLogicalCores, std::shared_ptr<std::mutex> mtx);
-void randomizeArray(int *arr, int n);
-void printArray(int *arr, int n);
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Counts the tasks forked into it that have not finished yet.
+class TaskGroup
+{
+public:
+    TaskGroup() : pending(0) {}
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+private:
+    friend class ThreadPool;
+    std::atomic<int> pending;
+};
+
+// Persistent fork-join pool. Every worker owns a deque, forks push to the back
+// of the forking thread's deque and are popped from there again (depth first),
+// idle workers steal from the front of the others (the biggest pieces). Threads
+// that join a group run tasks instead of blocking, so any thread may fork.
+class ThreadPool
+{
+public:
+    // the calling thread helps while it joins, so one worker less than cores
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void fork(TaskGroup &group, std::function<void()> fn);
+    void join(TaskGroup &group);
+
+    unsigned size() const { return static_cast<unsigned>(queues.size()); }
+
+private:
+    struct Task
+    {
+        std::function<void()> fn;
+        TaskGroup *group;
+    };
+
+    // deques are only touched under their own lock, forks are coarse enough
+    struct Queue
+    {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    void workerLoop(unsigned index);
+    bool tryRun(unsigned index);
+    unsigned currentQueue() const;
+
+    // one per worker plus one shared by threads outside the pool
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<int> queued;
+    std::atomic<bool> stopping;
+    std::mutex sleepMtx;
+    std::condition_variable sleepCv;
+};
+
+// the pool the convenience overloads of parallelMergeSort run on
+ThreadPool &defaultPool();
+
+// smallest output segment parallelMerge hands to a task
+constexpr std::size_t MERGE_GRAIN = 1 << 16;
+
+// ranges of at most this many elements are sorted by the base case
+constexpr std::size_t SMALL_SORT = 64;
+
+// default for parallelMergeSort: ranges larger than this are forked
+constexpr std::size_t LOWER_LIMIT = 1 << 12;
+
+// stable, the base case of every sort
+template <class It, class Compare>
+void insertionSort(It first, std::size_t n, Compare comp)
+{
+    for (std::size_t i = 1; i < n; i++)
+    {
+        auto value = std::move(first[i]);
+        std::size_t j = i;
+        while (j > 0 && comp(value, first[j - 1]))
+        {
+            first[j] = std::move(first[j - 1]);
+            j--;
+        }
+        first[j] = std::move(value);
+    }
+}
+
+void mergeRunsScalar(const int *a, std::size_t na, const int *b, std::size_t nb, int *out);
+void sortSmallScalar(int *arr, std::size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+void mergeRunsAvx2(const int *a, std::size_t na, const int *b, std::size_t nb, int *out);
+void sortSmallAvx2(int *arr, std::size_t n);
+#endif
+// int kernels, dispatched to the best the cpu supports. sortSmall is meant for
+// n <= SMALL_SORT, larger n still sorts but without the network.
+void mergeRuns(const int *a, std::size_t na, const int *b, std::size_t nb, int *out);
+void sortSmall(int *arr, std::size_t n);
+
+namespace detail
+{
+    // ints compared with < take the vectorized kernels, equal ints are
+    // indistinguishable so stability does not matter for them
+    template <class T, class Compare>
+    constexpr bool isIntLess = std::is_same_v<T, int> &&
+                               (std::is_same_v<Compare, std::less<int>> || std::is_same_v<Compare, std::less<>>);
+
+    template <class It>
+    constexpr bool isContiguous =
+        std::is_pointer_v<It> ||
+        std::is_same_v<It, typename std::vector<typename std::iterator_traits<It>::value_type>::iterator>;
+
+    template <class It>
+    using ValueType = typename std::iterator_traits<It>::value_type;
+
+    template <class It>
+    auto *toPointer(It it)
+    {
+        return std::addressof(*it);
+    }
+
+    // merges the sorted runs a[0..na) and b[0..nb) into out, a wins ties
+    template <class InIt, class OutIt, class Compare>
+    void mergeRuns(InIt a, std::size_t na, InIt b, std::size_t nb, OutIt out, Compare comp)
+    {
+        if constexpr (isIntLess<ValueType<InIt>, Compare> && isContiguous<InIt> && isContiguous<OutIt>)
+        {
+            ::mergeRuns(toPointer(a), na, toPointer(b), nb, toPointer(out));
+        }
+        else
+        {
+            std::size_t i = 0, j = 0;
+
+            while (i < na && j < nb)
+            {
+                if (comp(b[j], a[i]))
+                    *out++ = std::move(b[j++]);
+                else
+                    *out++ = std::move(a[i++]);
+            }
+
+            out = std::move(a + i, a + na, out);
+            std::move(b + j, b + nb, out);
+        }
+    }
+
+    // How many of the first k elements of the stable merge of a and b come
+    // from a. Binary search along the k-th cross diagonal of the merge path.
+    template <class It, class Compare>
+    std::size_t coRank(std::size_t k, It a, std::size_t na, It b, std::size_t nb, Compare comp)
+    {
+        std::size_t lo = k > nb ? k - nb : 0;
+        std::size_t hi = std::min(k, na);
+
+        while (lo < hi)
+        {
+            std::size_t i = lo + (hi - lo) / 2;
+            // a[i] has to come out before b[k - i - 1], so take more from a
+            if (!comp(b[k - i - 1], a[i]))
+                lo = i + 1;
+            else
+                hi = i;
+        }
+
+        return lo;
+    }
+
+    // Merges src[start, mid) and src[mid, end) into dst[start, end). Large
+    // merges are cut into equal output segments, coRank finds where each one
+    // starts in both runs and the segments are merged concurrently.
+    template <class SrcIt, class DstIt, class Compare>
+    void parallelMerge(SrcIt src, DstIt dst, std::size_t start, std::size_t mid, std::size_t end,
+                       Compare comp, ThreadPool &pool)
+    {
+        const std::size_t n = end - start;
+        const std::size_t segments = std::min<std::size_t>(n / MERGE_GRAIN, 4 * pool.size());
+
+        const SrcIt a = src + start;
+        const SrcIt b = src + mid;
+        const std::size_t na = mid - start;
+        const std::size_t nb = end - mid;
+
+        if (segments < 2)
+        {
+            mergeRuns(a, na, b, nb, dst + start, comp);
+            return;
+        }
+
+        TaskGroup group;
+        std::size_t kFirst = 0;
+        std::size_t iFirst = 0;
+        for (std::size_t s = 1; s <= segments; s++)
+        {
+            // n * s / segments without overflowing for huge n
+            const std::size_t kLast = n / segments * s + n % segments * s / segments;
+            const std::size_t iLast = (s == segments) ? na : coRank(kLast, a, na, b, nb, comp);
+            const std::size_t jFirst = kFirst - iFirst;
+            const std::size_t jLast = kLast - iLast;
+
+            auto segment = [=]
+            { mergeRuns(a + iFirst, iLast - iFirst, b + jFirst, jLast - jFirst, dst + start + kFirst, comp); };
+            if (s == segments)
+                segment();
+            else
+                pool.fork(group, segment);
+
+            kFirst = kLast;
+            iFirst = iLast;
+        }
+        pool.join(group);
+    }
+
+    template <class It, class Compare>
+    void sortLeaf(It first, std::size_t n, Compare comp)
+    {
+        if constexpr (isIntLess<ValueType<It>, Compare> && isContiguous<It>)
+            sortSmall(toPointer(first), n);
+        else
+            insertionSort(first, n, comp);
+    }
+
+    // Sorts [start, end) into dst, using src as scratch. Only one of the two
+    // holds the input on that range, dstHoldsInput says which. Each level sorts
+    // its halves from dst into src and merges them back, so source and
+    // destination swap on every level and no merge needs a buffer of its own.
+    template <class SrcIt, class DstIt, class Compare>
+    void sortInto(SrcIt src, DstIt dst, std::size_t start, std::size_t end, bool dstHoldsInput,
+                  std::size_t lowerLimit, Compare comp, ThreadPool &pool)
+    {
+        const std::size_t n = end - start;
+
+        if (n <= SMALL_SORT)
+        {
+            if (!dstHoldsInput)
+                std::move(src + start, src + end, dst + start);
+            sortLeaf(dst + start, n, comp);
+            return;
+        }
+
+        const std::size_t mid = start + n / 2;
+
+        if (n > lowerLimit)
+        {
+            // the left half may be stolen, the right half stays with us
+            TaskGroup group;
+            pool.fork(group, [=, &pool]
+                      { sortInto(dst, src, start, mid, !dstHoldsInput, lowerLimit, comp, pool); });
+            sortInto(dst, src, mid, end, !dstHoldsInput, lowerLimit, comp, pool);
+            pool.join(group);
+
+            parallelMerge(src, dst, start, mid, end, comp, pool);
+            return;
+        }
+
+        sortInto(dst, src, start, mid, !dstHoldsInput, lowerLimit, comp, pool);
+        sortInto(dst, src, mid, end, !dstHoldsInput, lowerLimit, comp, pool);
+        mergeRuns(src + start, mid - start, src + mid, end - mid, dst + start, comp);
+    }
+}
+
+// Stable parallel merge sort of [first, last) on pool. Ranges above lowerLimit
+// elements are forked. Needs one auxiliary buffer of last - first elements:
+// raw memory for trivially copyable types, otherwise the input is moved into a
+// vector first. Ints compared with < run on the vectorized kernels.
+template <class RandomIt, class Compare>
+void parallelMergeSort(RandomIt first, RandomIt last, Compare comp, ThreadPool &pool,
+                       std::size_t lowerLimit = LOWER_LIMIT)
+{
+    using T = detail::ValueType<RandomIt>;
+
+    const std::size_t n = static_cast<std::size_t>(last - first);
+    if (n < 2)
+        return;
+
+    if constexpr (std::is_trivially_copyable_v<T>)
+    {
+        std::allocator<T> allocator;
+        std::unique_ptr<T, std::function<void(T *)>> aux(allocator.allocate(n), [&](T *p)
+                                                         { allocator.deallocate(p, n); });
+        detail::sortInto(aux.get(), first, 0, n, true, lowerLimit, comp, pool);
+    }
+    else
+    {
+        std::vector<T> aux(std::make_move_iterator(first), std::make_move_iterator(last));
+        detail::sortInto(aux.begin(), first, 0, n, false, lowerLimit, comp, pool);
+    }
+}
+
+template <class RandomIt, class Compare>
+void parallelMergeSort(RandomIt first, RandomIt last, Compare comp)
+{
+    parallelMergeSort(first, last, comp, defaultPool());
+}
+
+template <class RandomIt>
+void parallelMergeSort(RandomIt first, RandomIt last)
+{
+    parallelMergeSort(first, last, std::less<>(), defaultPool());
+}
+
+// parallelSort: ranges below this many keys are merge sorted
+constexpr std::size_t RADIX_MIN = 1 << 16;
+
+// parallelSort counts keys when max - min is below this, radix sorts otherwise
+constexpr std::size_t COUNTING_RANGE = 1 << 16;
+
+// bits per radix pass
+constexpr int RADIX_BITS = 8;
+
+namespace detail
+{
+    constexpr std::size_t RADIX_BUCKETS = std::size_t(1) << RADIX_BITS;
+
+    // smallest block a single task scans or scatters
+    constexpr std::size_t SCAN_GRAIN = 1 << 14;
+
+    // runs fn(0) .. fn(count - 1) on the pool, the caller takes the last one
+    template <class Fn>
+    void forEachBlock(std::size_t count, ThreadPool &pool, Fn fn)
+    {
+        TaskGroup group;
+        for (std::size_t i = 0; i + 1 < count; i++)
+            pool.fork(group, [=]
+                      { fn(i); });
+        if (count > 0)
+            fn(count - 1);
+        pool.join(group);
+    }
+
+    inline std::size_t scanBlocks(std::size_t n, ThreadPool &pool)
+    {
+        return std::max<std::size_t>(std::min<std::size_t>(n / SCAN_GRAIN, 4 * pool.size()), 1);
+    }
+
+    // first index of block b when n elements are cut into blocks pieces
+    inline std::size_t blockStart(std::size_t n, std::size_t blocks, std::size_t b)
+    {
+        return n / blocks * b + std::min(b, n % blocks);
+    }
+
+    template <class T>
+    std::pair<T, T> minMax(const T *arr, std::size_t n, ThreadPool &pool)
+    {
+        const std::size_t blocks = scanBlocks(n, pool);
+        std::vector<std::pair<T, T>> partial(blocks);
+        forEachBlock(blocks, pool, [&](std::size_t b)
+                     {
+                         auto range = std::minmax_element(arr + blockStart(n, blocks, b), arr + blockStart(n, blocks, b + 1));
+                         partial[b] = {*range.first, *range.second}; });
+
+        std::pair<T, T> result = partial[0];
+        for (const auto &p : partial)
+        {
+            result.first = std::min(result.first, p.first);
+            result.second = std::max(result.second, p.second);
+        }
+        return result;
+    }
+
+    // true if a few hundred evenly spaced elements are in order, a hint that
+    // the input is presorted
+    template <class It, class Compare>
+    bool sampleSorted(It first, std::size_t n, Compare comp)
+    {
+        const std::size_t samples = 256;
+        const std::size_t step = n / samples;
+        if (step == 0)
+            return false;
+        for (std::size_t i = step; i < n; i += step)
+            if (comp(first[i], first[i - step]))
+                return false;
+        return true;
+    }
+
+    // Histograms every block, then writes each value's run of the output in
+    // parallel. No scratch buffer, only equal keys are lost track of.
+    template <class T>
+    void countingSort(T *arr, std::size_t n, T minKey, T maxKey, ThreadPool &pool)
+    {
+        using U = std::make_unsigned_t<T>;
+        const std::size_t buckets = static_cast<std::size_t>(U(maxKey) - U(minKey)) + 1;
+
+        // one histogram per thread, they can be large
+        const std::size_t blocks = std::min<std::size_t>(scanBlocks(n, pool), pool.size());
+        std::vector<std::size_t> counts(blocks * buckets);
+        forEachBlock(blocks, pool, [&](std::size_t b)
+                     {
+                         std::size_t *count = &counts[b * buckets];
+                         for (std::size_t i = blockStart(n, blocks, b); i < blockStart(n, blocks, b + 1); i++)
+                             count[U(arr[i]) - U(minKey)]++; });
+
+        // starts[v] is where the run of minKey + v begins
+        std::vector<std::size_t> starts(buckets + 1);
+        for (std::size_t v = 0; v < buckets; v++)
+        {
+            std::size_t total = 0;
+            for (std::size_t b = 0; b < blocks; b++)
+                total += counts[b * buckets + v];
+            starts[v + 1] = starts[v] + total;
+        }
+
+        // split by output position, so skewed keys are filled evenly
+        const std::size_t fills = scanBlocks(n, pool);
+        forEachBlock(fills, pool, [&](std::size_t b)
+                     {
+                         const std::size_t lo = blockStart(n, fills, b);
+                         const std::size_t hi = blockStart(n, fills, b + 1);
+                         std::size_t v = static_cast<std::size_t>(std::upper_bound(starts.begin(), starts.end(), lo) - starts.begin()) - 1;
+                         for (std::size_t i = lo; i < hi; v++)
+                         {
+                             const std::size_t end = std::min(starts[v + 1], hi);
+                             std::fill(arr + i, arr + end, static_cast<T>(U(minKey) + U(v)));
+                             i = end;
+                         } });
+    }
+
+    // LSD radix sort of the keys relative to minKey, so only digits that vary
+    // across the input get a pass and signed keys need no bit flipping. Every
+    // pass histograms the blocks in parallel, lays the buckets out digit by
+    // digit and block by block (keeping it stable) and scatters in parallel.
+    template <class T>
+    void radixSort(T *arr, std::size_t n, T minKey, T maxKey, ThreadPool &pool)
+    {
+        using U = std::make_unsigned_t<T>;
+        const U range = U(maxKey) - U(minKey);
+        const U base = U(minKey);
+        const int bits = std::numeric_limits<U>::digits;
+
+        std::unique_ptr<T[]> aux(new T[n]);
+        T *src = arr;
+        T *dst = aux.get();
+
+        const std::size_t blocks = scanBlocks(n, pool);
+        std::vector<std::size_t> counts(blocks * RADIX_BUCKETS);
+
+        for (int shift = 0; shift < bits && (range >> shift) != 0; shift += RADIX_BITS)
+        {
+            auto digit = [=](T key)
+            { return static_cast<std::size_t>(((U(key) - base) >> shift) & (RADIX_BUCKETS - 1)); };
+
+            forEachBlock(blocks, pool, [&](std::size_t b)
+                         {
+                             std::size_t *count = &counts[b * RADIX_BUCKETS];
+                             std::fill(count, count + RADIX_BUCKETS, 0);
+                             for (std::size_t i = blockStart(n, blocks, b); i < blockStart(n, blocks, b + 1); i++)
+                                 count[digit(src[i])]++; });
+
+            // exclusive prefix sum in digit major, block minor order
+            std::size_t sum = 0;
+            bool trivial = false;
+            for (std::size_t d = 0; d < RADIX_BUCKETS; d++)
+            {
+                const std::size_t before = sum;
+                for (std::size_t b = 0; b < blocks; b++)
+                {
+                    const std::size_t count = counts[b * RADIX_BUCKETS + d];
+                    counts[b * RADIX_BUCKETS + d] = sum;
+                    sum += count;
+                }
+                trivial = trivial || sum - before == n;
+            }
+            // every key has the same digit, the pass would only copy
+            if (trivial)
+                continue;
+
+            forEachBlock(blocks, pool, [&](std::size_t b)
+                         {
+                             std::size_t *next = &counts[b * RADIX_BUCKETS];
+                             for (std::size_t i = blockStart(n, blocks, b); i < blockStart(n, blocks, b + 1); i++)
+                                 dst[next[digit(src[i])]++] = src[i]; });
+            std::swap(src, dst);
+        }
+
+        if (src != arr)
+            forEachBlock(blocks, pool, [&](std::size_t b)
+                         { std::copy(src + blockStart(n, blocks, b), src + blockStart(n, blocks, b + 1), arr + blockStart(n, blocks, b)); });
+    }
+}
+
+// a run that wins this many times in a row is merged by galloping
+constexpr std::size_t MIN_GALLOP = 7;
+
+// parallelAdaptiveSort merge sorts chunks whose natural runs are shorter on average
+constexpr std::size_t MIN_NATURAL_RUN = 32;
+
+namespace detail
+{
+    // number of elements of the sorted a[0..n) not greater than key. Probes
+    // 1, 3, 7, ... ahead before the binary search, so short answers are cheap.
+    template <class T, class It, class Compare>
+    std::size_t gallopRight(const T &key, It a, std::size_t n, Compare comp)
+    {
+        std::size_t lo = 0, hi = 1;
+        while (hi <= n && !comp(key, a[hi - 1]))
+        {
+            lo = hi;
+            hi = 2 * hi + 1;
+        }
+        hi = std::min(hi, n);
+        return lo + static_cast<std::size_t>(std::upper_bound(a + lo, a + hi, key, comp) - (a + lo));
+    }
+
+    // number of elements of the sorted a[0..n) less than key
+    template <class T, class It, class Compare>
+    std::size_t gallopLeft(const T &key, It a, std::size_t n, Compare comp)
+    {
+        std::size_t lo = 0, hi = 1;
+        while (hi <= n && comp(a[hi - 1], key))
+        {
+            lo = hi;
+            hi = 2 * hi + 1;
+        }
+        hi = std::min(hi, n);
+        return lo + static_cast<std::size_t>(std::lower_bound(a + lo, a + hi, key, comp) - (a + lo));
+    }
+
+    // Length of the natural run at first. Strictly descending runs are
+    // reversed, equal keys never start one, so that stays stable.
+    template <class It, class Compare>
+    std::size_t countRun(It first, std::size_t n, Compare comp)
+    {
+        if (n < 2)
+            return n;
+
+        std::size_t i = 2;
+        if (comp(first[1], first[0]))
+        {
+            while (i < n && comp(first[i], first[i - 1]))
+                i++;
+            std::reverse(first, first + i);
+        }
+        else
+        {
+            while (i < n && !comp(first[i], first[i - 1]))
+                i++;
+        }
+        return i;
+    }
+
+    // true if [first, first + n) has at most n / MIN_NATURAL_RUN natural runs,
+    // counted the way countRun finds them, but without reversing any
+    template <class It, class Compare>
+    bool hasLongRuns(It first, std::size_t n, Compare comp)
+    {
+        const std::size_t maxRuns = n / MIN_NATURAL_RUN;
+        std::size_t runs = 0;
+
+        for (std::size_t i = 0; i < n; runs++)
+        {
+            if (runs > maxRuns)
+                return false;
+
+            std::size_t j = i + 1;
+            if (j < n && comp(first[j], first[i]))
+            {
+                while (j < n && comp(first[j], first[j - 1]))
+                    j++;
+            }
+            else
+            {
+                while (j < n && !comp(first[j], first[j - 1]))
+                    j++;
+            }
+            i = j;
+        }
+        return runs <= maxRuns;
+    }
+
+    // shorter runs are extended to this, between 32 and 64 and chosen so
+    // that n / minRun is close to a power of two
+    inline std::size_t minRunLength(std::size_t n)
+    {
+        std::size_t r = 0;
+        while (n >= 64)
+        {
+            r |= n & 1;
+            n >>= 1;
+        }
+        return n + r;
+    }
+
+    // Merges the adjacent sorted runs first[0, mid) and first[mid, n) in
+    // place. The parts that already are in position are cut off by galloping
+    // first, the left run is moved to tmp and merged back one element at a
+    // time until one side keeps winning, then whole blocks are galloped over.
+    template <class It, class Compare>
+    void mergeGalloping(It first, std::size_t mid, std::size_t n, std::vector<ValueType<It>> &tmp, Compare comp)
+    {
+        const std::size_t skip = gallopRight(first[mid], first, mid, comp);
+        first += skip;
+        mid -= skip;
+        n -= skip;
+        if (mid == 0)
+            return;
+        n = mid + gallopLeft(first[mid - 1], first + mid, n - mid, comp);
+
+        tmp.assign(std::make_move_iterator(first), std::make_move_iterator(first + mid));
+        auto a = tmp.begin();
+        It b = first + mid;
+        It out = first;
+        std::size_t i = 0, j = 0;
+        const std::size_t na = mid, nb = n - mid;
+
+        while (i < na && j < nb)
+        {
+            std::size_t winsA = 0, winsB = 0;
+            while (i < na && j < nb && winsA < MIN_GALLOP && winsB < MIN_GALLOP)
+            {
+                if (comp(b[j], a[i]))
+                {
+                    *out++ = std::move(b[j++]);
+                    winsB++;
+                    winsA = 0;
+                }
+                else
+                {
+                    *out++ = std::move(a[i++]);
+                    winsA++;
+                    winsB = 0;
+                }
+            }
+            if (i == na || j == nb)
+                break;
+
+            std::size_t count = gallopRight(b[j], a + i, na - i, comp);
+            out = std::move(a + i, a + i + count, out);
+            i += count;
+            if (i == na)
+                break;
+
+            count = gallopLeft(a[i], b + j, nb - j, comp);
+            out = std::move(b + j, b + j + count, out);
+            j += count;
+        }
+
+        // what is left of b already is in place
+        std::move(a + i, a + na, out);
+    }
+
+    // Sequential natural merge sort in the manner of TimSort: finds the runs
+    // already in the input, extends short ones by insertion sort and merges
+    // them off a stack kept in balance, so presorted input costs one pass.
+    template <class It, class Compare>
+    void timSort(It first, std::size_t n, Compare comp)
+    {
+        if (n < 2)
+            return;
+
+        const std::size_t minRun = minRunLength(n);
+        std::vector<std::pair<std::size_t, std::size_t>> runs; // start, length
+        std::vector<ValueType<It>> tmp;
+
+        auto mergeAt = [&](std::size_t k)
+        {
+            mergeGalloping(first + runs[k].first, runs[k].second, runs[k].second + runs[k + 1].second, tmp, comp);
+            runs[k].second += runs[k + 1].second;
+            runs.erase(runs.begin() + static_cast<std::ptrdiff_t>(k) + 1);
+        };
+
+        for (std::size_t start = 0; start < n;)
+        {
+            std::size_t length = countRun(first + start, n - start, comp);
+            if (length < minRun)
+            {
+                length = std::min(minRun, n - start);
+                insertionSort(first + start, length, comp);
+            }
+            runs.emplace_back(start, length);
+            start += length;
+
+            // run lengths have to shrink at least like Fibonacci numbers
+            // towards the top, which keeps the merges balanced
+            while (runs.size() > 1)
+            {
+                std::size_t k = runs.size() - 2;
+                if ((k > 0 && runs[k - 1].second <= runs[k].second + runs[k + 1].second) ||
+                    (k > 1 && runs[k - 2].second <= runs[k - 1].second + runs[k].second))
+                {
+                    if (runs[k - 1].second < runs[k + 1].second)
+                        k--;
+                }
+                else if (runs[k].second > runs[k + 1].second)
+                    break;
+                mergeAt(k);
+            }
+        }
+
+        while (runs.size() > 1)
+            mergeAt(runs.size() - 2);
+    }
+
+    // Merges the adjacent sorted ranges [lo, mid) and [mid, hi) of first,
+    // trimmed like mergeGalloping, the rest through parallelMerge.
+    template <class RandomIt, class Compare>
+    void mergeAdjacent(RandomIt first, std::size_t lo, std::size_t mid, std::size_t hi, Compare comp, ThreadPool &pool)
+    {
+        lo += gallopRight(first[mid], first + lo, mid - lo, comp);
+        if (lo == mid)
+            return;
+        hi = mid + gallopLeft(first[mid - 1], first + mid, hi - mid, comp);
+
+        std::vector<ValueType<RandomIt>> runs(std::make_move_iterator(first + lo), std::make_move_iterator(first + hi));
+        parallelMerge(runs.begin(), first + lo, 0, mid - lo, hi - lo, comp, pool);
+    }
+}
+
+// Stable sort that adapts to existing order, for appended logs, merged shards
+// and other nearly sorted input. Every thread takes one chunk and sorts it
+// with a natural merge sort (see detail::timSort) if it holds long runs, with
+// parallelMergeSort otherwise. Then neighbouring chunks are merged pairwise
+// level by level. Sorted input runs in O(n), random input stays parallel.
+template <class RandomIt, class Compare = std::less<>>
+void parallelAdaptiveSort(RandomIt first, RandomIt last, Compare comp = Compare(), ThreadPool &pool = defaultPool())
+{
+    const std::size_t n = static_cast<std::size_t>(last - first);
+    if (n < 2)
+        return;
+
+    const std::size_t chunks = std::max<std::size_t>(std::min<std::size_t>(pool.size(), n / detail::SCAN_GRAIN), 1);
+    detail::forEachBlock(chunks, pool, [&](std::size_t b)
+                         {
+                             const std::size_t start = detail::blockStart(n, chunks, b);
+                             const std::size_t length = detail::blockStart(n, chunks, b + 1) - start;
+                             if (detail::hasLongRuns(first + start, length, comp))
+                                 detail::timSort(first + start, length, comp);
+                             else
+                                 parallelMergeSort(first + start, first + start + length, comp, pool); });
+
+    for (std::size_t width = 1; width < chunks; width *= 2)
+    {
+        const std::size_t pairs = (chunks + 2 * width - 1) / (2 * width);
+        detail::forEachBlock(pairs, pool, [&](std::size_t p)
+                             {
+                                 const std::size_t c = 2 * width * p;
+                                 if (c + width >= chunks)
+                                     return;
+                                 detail::mergeAdjacent(first, detail::blockStart(n, chunks, c),
+                                                       detail::blockStart(n, chunks, c + width),
+                                                       detail::blockStart(n, chunks, std::min(c + 2 * width, chunks)),
+                                                       comp, pool); });
+    }
+}
+
+// Parallel LSD radix sort of integer keys in ascending order. Needs a scratch
+// buffer of last - first keys.
+template <class T>
+void parallelRadixSort(T *first, T *last, ThreadPool &pool = defaultPool())
+{
+    static_assert(std::is_integral_v<T>, "radix sort needs integer keys");
+    const std::size_t n = static_cast<std::size_t>(last - first);
+    if (n < 2)
+        return;
+
+    auto [minKey, maxKey] = detail::minMax(first, n, pool);
+    detail::radixSort(first, n, minKey, maxKey, pool);
+}
+
+// Parallel counting sort of integer keys in ascending order. Returns false and
+// leaves the keys alone when max - min is not below COUNTING_RANGE.
+template <class T>
+bool parallelCountingSort(T *first, T *last, ThreadPool &pool = defaultPool())
+{
+    static_assert(std::is_integral_v<T>, "counting sort needs integer keys");
+    const std::size_t n = static_cast<std::size_t>(last - first);
+    if (n < 2)
+        return true;
+
+    using U = std::make_unsigned_t<T>;
+    auto [minKey, maxKey] = detail::minMax(first, n, pool);
+    if (static_cast<std::size_t>(U(maxKey) - U(minKey)) >= COUNTING_RANGE)
+        return false;
+
+    detail::countingSort(first, n, minKey, maxKey, pool);
+    return true;
+}
+
+// Sorts in ascending order with the backend that suits the input. If a sample
+// looks presorted, the adaptive sort finishes in about one pass. Otherwise one
+// parallel pass finds the range of contiguous integer keys: narrow ranges are
+// counted, wide ones radix sorted. Short ranges and all other types are merge
+// sorted.
+template <class RandomIt>
+void parallelSort(RandomIt first, RandomIt last, ThreadPool &pool = defaultPool())
+{
+    using T = detail::ValueType<RandomIt>;
+    const std::size_t n = static_cast<std::size_t>(last - first);
+
+    if (n >= RADIX_MIN && detail::sampleSorted(first, n, std::less<>()))
+    {
+        parallelAdaptiveSort(first, last, std::less<>(), pool);
+        return;
+    }
+
+    if constexpr (std::is_integral_v<T> && !std::is_same_v<T, bool> && detail::isContiguous<RandomIt>)
+    {
+        if (n >= RADIX_MIN)
+        {
+            T *arr = detail::toPointer(first);
+            using U = std::make_unsigned_t<T>;
+            auto [minKey, maxKey] = detail::minMax(arr, n, pool);
+            const std::size_t range = static_cast<std::size_t>(U(maxKey) - U(minKey));
+            if (range < COUNTING_RANGE && range <= n)
+                detail::countingSort(arr, n, minKey, maxKey, pool);
+            else
+                detail::radixSort(arr, n, minKey, maxKey, pool);
+            return;
+        }
+    }
+
+    parallelMergeSort(first, last, std::less<>(), pool);
+}
+
+namespace detail
+{
+    // what argsort and sortByKey merge instead of the records: the key and
+    // where it came from
+    template <class K, class Index>
+    struct KeyIndex
+    {
+        K key;
+        Index index;
+    };
+
+    // keys cheap enough to copy through the merge next to their index
+    template <class K>
+    constexpr bool isPackable = std::is_trivially_copyable_v<K> && sizeof(K) <= 16;
+
+    // Sorts copies of the keys paired with their positions and hands the
+    // sorted pairs to consume. Merging on the key alone keeps it stable.
+    template <class Index, class RandomIt, class Compare, class Consume>
+    void sortKeyIndex(RandomIt first, std::size_t n, Compare comp, ThreadPool &pool, Consume consume)
+    {
+        using K = ValueType<RandomIt>;
+        std::vector<KeyIndex<K, Index>> pairs(n);
+
+        const std::size_t blocks = scanBlocks(n, pool);
+        forEachBlock(blocks, pool, [&](std::size_t b)
+                     {
+                         for (std::size_t i = blockStart(n, blocks, b); i < blockStart(n, blocks, b + 1); i++)
+                             pairs[i] = {first[i], static_cast<Index>(i)}; });
+
+        parallelMergeSort(pairs.begin(), pairs.end(), [comp](const KeyIndex<K, Index> &a, const KeyIndex<K, Index> &b)
+                          { return comp(a.key, b.key); },
+                          pool);
+        consume(pairs);
+    }
+
+    // positions sorted by the keys they point at, for keys too big to move
+    template <class RandomIt, class Compare>
+    std::vector<std::size_t> sortIndirect(RandomIt first, std::size_t n, Compare comp, ThreadPool &pool)
+    {
+        std::vector<std::size_t> perm(n);
+        for (std::size_t i = 0; i < n; i++)
+            perm[i] = i;
+        parallelMergeSort(perm.begin(), perm.end(), [first, comp](std::size_t a, std::size_t b)
+                          { return comp(first[a], first[b]); },
+                          pool);
+        return perm;
+    }
+
+    // first[i] = old first[index(i)] for all i, gathered in parallel
+    template <class RandomIt, class IndexFn>
+    void applyPermutation(RandomIt first, std::size_t n, IndexFn index, ThreadPool &pool)
+    {
+        using V = ValueType<RandomIt>;
+        const std::size_t blocks = scanBlocks(n, pool);
+
+        std::vector<V> gathered;
+        if constexpr (std::is_default_constructible_v<V>)
+        {
+            gathered.resize(n);
+            forEachBlock(blocks, pool, [&](std::size_t b)
+                         {
+                             for (std::size_t i = blockStart(n, blocks, b); i < blockStart(n, blocks, b + 1); i++)
+                                 gathered[i] = std::move(first[index(i)]); });
+        }
+        else
+        {
+            gathered.reserve(n);
+            for (std::size_t i = 0; i < n; i++)
+                gathered.push_back(std::move(first[index(i)]));
+        }
+
+        forEachBlock(blocks, pool, [&](std::size_t b)
+                     { std::move(gathered.begin() + blockStart(n, blocks, b), gathered.begin() + blockStart(n, blocks, b + 1),
+                                 first + blockStart(n, blocks, b)); });
+    }
+}
+
+// Stable argsort: returns perm such that first[perm[0]], first[perm[1]], ...
+// is in order, equal keys in their original order. Small trivially copyable
+// keys are merged together with a 32 bit index when the range allows, others
+// are sorted indirectly. The range itself is left untouched.
+template <class RandomIt, class Compare = std::less<>>
+std::vector<std::size_t> parallelArgsort(RandomIt first, RandomIt last, Compare comp = Compare(),
+                                         ThreadPool &pool = defaultPool())
+{
+    const std::size_t n = static_cast<std::size_t>(last - first);
+
+    if constexpr (detail::isPackable<detail::ValueType<RandomIt>>)
+    {
+        std::vector<std::size_t> perm(n);
+        auto consume = [&](const auto &pairs)
+        {
+            const std::size_t blocks = detail::scanBlocks(n, pool);
+            detail::forEachBlock(blocks, pool, [&](std::size_t b)
+                                 {
+                                     for (std::size_t i = detail::blockStart(n, blocks, b); i < detail::blockStart(n, blocks, b + 1); i++)
+                                         perm[i] = pairs[i].index; });
+        };
+
+        if (n <= std::numeric_limits<std::uint32_t>::max())
+            detail::sortKeyIndex<std::uint32_t>(first, n, comp, pool, consume);
+        else
+            detail::sortKeyIndex<std::size_t>(first, n, comp, pool, consume);
+        return perm;
+    }
+    else
+        return detail::sortIndirect(first, n, comp, pool);
+}
+
+// Sorts the keys [keysFirst, keysLast) and moves the values starting at
+// valuesFirst along with them (structure of arrays). Stable. Only keys and
+// indices go through the merge, every value is moved into place once at the
+// end, so the size of the payload does not matter.
+template <class KeyIt, class ValueIt, class Compare = std::less<>>
+void parallelSortByKey(KeyIt keysFirst, KeyIt keysLast, ValueIt valuesFirst, Compare comp = Compare(),
+                       ThreadPool &pool = defaultPool())
+{
+    const std::size_t n = static_cast<std::size_t>(keysLast - keysFirst);
+    if (n < 2)
+        return;
+
+    if constexpr (detail::isPackable<detail::ValueType<KeyIt>>)
+    {
+        auto consume = [&](const auto &pairs)
+        {
+            const std::size_t blocks = detail::scanBlocks(n, pool);
+            detail::forEachBlock(blocks, pool, [&](std::size_t b)
+                                 {
+                                     for (std::size_t i = detail::blockStart(n, blocks, b); i < detail::blockStart(n, blocks, b + 1); i++)
+                                         keysFirst[i] = pairs[i].key; });
+            detail::applyPermutation(valuesFirst, n, [&](std::size_t i)
+                                     { return pairs[i].index; },
+                                     pool);
+        };
+
+        if (n <= std::numeric_limits<std::uint32_t>::max())
+            detail::sortKeyIndex<std::uint32_t>(keysFirst, n, comp, pool, consume);
+        else
+            detail::sortKeyIndex<std::size_t>(keysFirst, n, comp, pool, consume);
+    }
+    else
+    {
+        const std::vector<std::size_t> perm = detail::sortIndirect(keysFirst, n, comp, pool);
+        auto index = [&](std::size_t i)
+        { return perm[i]; };
+        detail::applyPermutation(keysFirst, n, index, pool);
+        detail::applyPermutation(valuesFirst, n, index, pool);
+    }
+}
+
+struct ExternalSortOptions
+{
+    // 4 for int32 keys, 8 for int64 keys, native byte order
+    int keyBytes = 4;
+    // where the sorted runs are written, they are unlinked right away
+    std::string tempDir = "/tmp";
+    // bytes used for sorting chunks and for the merge buffers
+    std::size_t memoryBudget = std::size_t(1) << 30;
+};
+
+// Sorts a binary file of keys that may be far larger than memory. Chunks of
+// half the budget are mapped, sorted in parallel and written as runs, which a
+// loser tree then merges k ways into output, k bounded by the budget and by
+// the free file descriptors. Throws std::system_error when a file operation
+// fails.
+void externalSort(const char *input, const char *output, const ExternalSortOptions &options, ThreadPool &pool);
+
+void mergeSort(int *arr, int start, int end, int lowerLimit, ThreadPool &pool);
+void randomizeArray(int *arr, std::size_t n);
+void printArray(int *arr, std::size_t n);
+bool isSorted(int *arr, std::size_t n);
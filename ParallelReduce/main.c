@@ -3,12 +3,56 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
 
-void *parallel_reduce_inner(void *arg);
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-int parallel_reduce(int (*op)(int, int),
-                    int *data,
-                    int len);
+// chunks smaller than this are not worth waking a worker for
+#define REDUCE_GRAIN 16384
+
+#define CACHE_LINE 64
+
+// one per thread, so no two threads ever write the same cache line
+union padded_value
+{
+    int i32;
+    int64_t i64;
+    float f32;
+    double f64;
+    char pad[CACHE_LINE];
+};
+
+// Persistent workers that all run the same job, one call at a time. The
+// calling thread takes part as tid 0, so a pool of n threads starts n - 1.
+// Callers from several threads take turns on lock. A job must not run
+// anything on its own pool, that deadlocks on lock and the barriers.
+struct worker_pool
+{
+    int number_of_threads;
+    pthread_t *threads;
+    struct worker_arg *args;
+    pthread_mutex_t lock;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    void (*job)(void *arg, int tid, int number_of_threads);
+    void *job_arg;
+    int stopping;
+    // per thread results of the current job, cache line aligned, only
+    // touched by whoever holds lock
+    union padded_value *partials;
+};
+
+struct worker_arg
+{
+    struct worker_pool *pool;
+    int tid;
+};
 
 int max(int a, int b)
 {
@@ -26,181 +70,994 @@ int product(int a, int b)
 }
 
 int reduce(int (*op)(int, int),
-           int *data,
-           int len)
+           const int *data,
+           size_t len)
 {
-    int i;
+    size_t i;
     int result = data[0];
     for (i = 1; i < len; ++i)
         result = op(result, data[i]);
     return result;
 }
 
-int find_max_exp_2(int n)
+// reduces data[0..len) with one fixed op, len must not be 0
+typedef int (*reduce_kernel)(const int *data, size_t len);
+
+// Kernels with the op spelled out instead of called through a pointer. Four
+// independent accumulators keep the adds, maxes and multiplies in flight.
+#define SCALAR_KERNEL(name, combine, identity, type)               \
+    type name##_scalar(const type *data, size_t len)               \
+    {                                                              \
+        type acc0 = identity, acc1 = identity;                     \
+        type acc2 = identity, acc3 = identity;                     \
+        size_t i = 0;                                              \
+        for (; i + 4 <= len; i += 4)                               \
+        {                                                          \
+            acc0 = combine(acc0, data[i]);                         \
+            acc1 = combine(acc1, data[i + 1]);                     \
+            acc2 = combine(acc2, data[i + 2]);                     \
+            acc3 = combine(acc3, data[i + 3]);                     \
+        }                                                          \
+        for (; i < len; i++)                                       \
+            acc0 = combine(acc0, data[i]);                         \
+        return combine(combine(acc0, acc1), combine(acc2, acc3));  \
+    }
+
+SCALAR_KERNEL(sum, sum, 0, int)
+SCALAR_KERNEL(max, max, INT_MIN, int)
+SCALAR_KERNEL(product, product, 1, int)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The same with vectors of lanes ints: four vector accumulators, folded into
+// one vector, its lanes and the tail are combined in scalar.
+#define SIMD_KERNEL(name, isa, target_isa, vector, lanes, set1, load, vop, combine, identity) \
+    __attribute__((target(target_isa))) int name##_##isa(const int *data, size_t len)        \
+    {                                                                                        \
+        vector acc0 = set1(identity), acc1 = acc0, acc2 = acc0, acc3 = acc0;                 \
+        size_t i = 0;                                                                        \
+        for (; i + 4 * (lanes) <= len; i += 4 * (lanes))                                     \
+        {                                                                                    \
+            acc0 = vop(acc0, load(data + i));                                                \
+            acc1 = vop(acc1, load(data + i + (lanes)));                                      \
+            acc2 = vop(acc2, load(data + i + 2 * (lanes)));                                  \
+            acc3 = vop(acc3, load(data + i + 3 * (lanes)));                                  \
+        }                                                                                    \
+        acc0 = vop(vop(acc0, acc1), vop(acc2, acc3));                                        \
+        int lane[lanes];                                                                     \
+        memcpy(lane, &acc0, sizeof(lane));                                                   \
+        int result = identity;                                                               \
+        for (int j = 0; j < (lanes); j++)                                                    \
+            result = combine(result, lane[j]);                                               \
+        for (; i < len; i++)                                                                 \
+            result = combine(result, data[i]);                                               \
+        return result;                                                                       \
+    }
+
+#define LOAD_SSE(p) _mm_loadu_si128((const __m128i *)(p))
+#define LOAD_AVX2(p) _mm256_loadu_si256((const __m256i *)(p))
+#define LOAD_AVX512(p) _mm512_loadu_si512((const void *)(p))
+
+SIMD_KERNEL(sum, sse41, "sse4.1", __m128i, 4, _mm_set1_epi32, LOAD_SSE, _mm_add_epi32, sum, 0)
+SIMD_KERNEL(max, sse41, "sse4.1", __m128i, 4, _mm_set1_epi32, LOAD_SSE, _mm_max_epi32, max, INT_MIN)
+SIMD_KERNEL(product, sse41, "sse4.1", __m128i, 4, _mm_set1_epi32, LOAD_SSE, _mm_mullo_epi32, product, 1)
+
+SIMD_KERNEL(sum, avx2, "avx2", __m256i, 8, _mm256_set1_epi32, LOAD_AVX2, _mm256_add_epi32, sum, 0)
+SIMD_KERNEL(max, avx2, "avx2", __m256i, 8, _mm256_set1_epi32, LOAD_AVX2, _mm256_max_epi32, max, INT_MIN)
+SIMD_KERNEL(product, avx2, "avx2", __m256i, 8, _mm256_set1_epi32, LOAD_AVX2, _mm256_mullo_epi32, product, 1)
+
+SIMD_KERNEL(sum, avx512, "avx512f", __m512i, 16, _mm512_set1_epi32, LOAD_AVX512, _mm512_add_epi32, sum, 0)
+SIMD_KERNEL(max, avx512, "avx512f", __m512i, 16, _mm512_set1_epi32, LOAD_AVX512, _mm512_max_epi32, max, INT_MIN)
+SIMD_KERNEL(product, avx512, "avx512f", __m512i, 16, _mm512_set1_epi32, LOAD_AVX512, _mm512_mullo_epi32, product, 1)
+
+#endif
+
+// the best kernels this cpu runs, picked once
+struct reduce_kernels
 {
-    int exp = 1;
-    while (exp <= n)
+    reduce_kernel sum;
+    reduce_kernel max;
+    reduce_kernel product;
+};
+
+struct reduce_kernels kernels = {sum_scalar, max_scalar, product_scalar};
+pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+void kernels_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        kernels.sum = sum_avx512;
+        kernels.max = max_avx512;
+        kernels.product = product_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.sum = sum_avx2;
+        kernels.max = max_avx2;
+        kernels.product = product_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
     {
-        exp *= 2;
+        kernels.sum = sum_sse41;
+        kernels.max = max_sse41;
+        kernels.product = product_sse41;
     }
-    return exp / 2;
+#endif
 }
 
-struct kernel_arg
+// the specialized kernel for one of the built in ops, NULL for any other op
+reduce_kernel find_kernel(int (*op)(int, int))
 {
-    int tid;
-    int number_of_threads;
-    int (*op)(int, int);
-    int *data;
-    int len;
-    pthread_barrier_t *barrier;
-};
+    pthread_once(&kernels_once, kernels_init);
+
+    if (op == sum)
+        return kernels.sum;
+    if (op == max)
+        return kernels.max;
+    if (op == product)
+        return kernels.product;
+    return NULL;
+}
+
+void *worker_main(void *arg)
+{
+    struct worker_arg *worker_arg = (struct worker_arg *)arg;
+    struct worker_pool *pool = worker_arg->pool;
+
+    while (1)
+    {
+        // the barriers also publish job, job_arg and stopping
+        pthread_barrier_wait(&pool->start);
+        if (pool->stopping)
+            return NULL;
+
+        pool->job(pool->job_arg, worker_arg->tid, pool->number_of_threads);
+        pthread_barrier_wait(&pool->done);
+    }
+}
 
-void *kernel(void *arg)
+void worker_pool_init(struct worker_pool *pool, int number_of_threads)
 {
-    struct kernel_arg *kernel_arg = (struct kernel_arg *)arg;
+    if (number_of_threads < 1)
+        number_of_threads = 1;
+
+    pool->number_of_threads = number_of_threads;
+    pool->stopping = 0;
+    pool->threads = malloc(sizeof(pthread_t) * number_of_threads);
+    pool->args = malloc(sizeof(struct worker_arg) * number_of_threads);
+    if (pool->threads == NULL || pool->args == NULL ||
+        posix_memalign((void **)&pool->partials, CACHE_LINE, sizeof(union padded_value) * number_of_threads) != 0)
+    {
+        exit(-1);
+    }
 
-    const int tid = kernel_arg->tid;
-    int step_size = 1;
-    int number_of_threads = kernel_arg->number_of_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_barrier_init(&pool->start, NULL, number_of_threads);
+    pthread_barrier_init(&pool->done, NULL, number_of_threads);
 
-    while (number_of_threads > 0)
+    for (int i = 1; i < number_of_threads; i++)
     {
+        pool->args[i].pool = pool;
+        pool->args[i].tid = i;
+        pthread_create(&pool->threads[i], NULL, worker_main, (void *)(pool->args + i));
+    }
+}
 
-        if (tid < number_of_threads)
-        {
-            const int fst = tid * step_size * 2;
-            const int snd = fst + step_size;
-            kernel_arg->data[fst] = kernel_arg->op(kernel_arg->data[fst], kernel_arg->data[snd]);
-        }
+// Takes the pool for one call, from running its jobs until the caller has
+// combined their results. Every worker_pool_run needs it held. Returns the
+// partials, which are the caller's until worker_pool_unlock.
+union padded_value *worker_pool_lock(struct worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    return pool->partials;
+}
+
+void worker_pool_unlock(struct worker_pool *pool)
+{
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// runs job(arg, tid, number_of_threads) on every thread of the pool and
+// returns once all are done, the caller holds the pool lock
+void worker_pool_run(struct worker_pool *pool,
+                     void (*job)(void *arg, int tid, int number_of_threads),
+                     void *arg)
+{
+    pool->job = job;
+    pool->job_arg = arg;
+
+    if (pool->number_of_threads == 1)
+    {
+        job(arg, 0, 1);
+        return;
+    }
 
-        step_size = step_size << 1;
-        number_of_threads = number_of_threads >> 1;
+    pthread_barrier_wait(&pool->start);
+    job(arg, 0, pool->number_of_threads);
+    pthread_barrier_wait(&pool->done);
+}
 
-        pthread_barrier_wait(kernel_arg->barrier);
+void worker_pool_destroy(struct worker_pool *pool)
+{
+    if (pool->number_of_threads > 1)
+    {
+        pool->stopping = 1;
+        pthread_barrier_wait(&pool->start);
     }
 
-    return NULL;
+    for (int i = 1; i < pool->number_of_threads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->partials);
+    free(pool->args);
+    free(pool->threads);
+}
+
+struct worker_pool default_pool;
+pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+
+void default_pool_init(void)
+{
+    worker_pool_init(&default_pool, (int)sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+// one thread per online cpu, started on first use
+struct worker_pool *worker_pool_default(void)
+{
+    pthread_once(&default_pool_once, default_pool_init);
+    return &default_pool;
+}
+
+// first index of chunk i when len elements are split into n chunks
+size_t chunk_begin(size_t len, size_t n, size_t i)
+{
+    return len / n * i + (i < len % n ? i : len % n);
+}
+
+struct chunk_job
+{
+    void (*chunk)(void *arg, size_t begin, size_t end, int tid);
+    void *arg;
+    size_t len;
+    int number_of_chunks;
+};
+
+void chunk_job_run(void *arg, int tid, int number_of_threads)
+{
+    struct chunk_job *job = (struct chunk_job *)arg;
+    (void)number_of_threads;
+
+    if (tid >= job->number_of_chunks)
+        return;
+
+    job->chunk(job->arg,
+               chunk_begin(job->len, job->number_of_chunks, tid),
+               chunk_begin(job->len, job->number_of_chunks, tid + 1),
+               tid);
 }
 
-struct parallel_reduce_inner_arg
+// how many chunks run_chunked splits len elements into
+int chunk_count(struct worker_pool *pool, size_t len)
+{
+    size_t number_of_chunks = (len + REDUCE_GRAIN - 1) / REDUCE_GRAIN;
+    if (number_of_chunks > (size_t)pool->number_of_threads)
+        number_of_chunks = pool->number_of_threads;
+    return number_of_chunks > 0 ? (int)number_of_chunks : 1;
+}
+
+// Splits len elements into at most one contiguous chunk per thread, none
+// shorter than REDUCE_GRAIN, and runs chunk(arg, begin, end, tid) for each on
+// the pool. Returns the number of chunks. The split only depends on len and
+// the size of the pool, which keeps results of inexact ops reproducible. The
+// caller holds the pool lock until it is done with the results.
+int run_chunked(struct worker_pool *pool,
+                size_t len,
+                void (*chunk)(void *arg, size_t begin, size_t end, int tid),
+                void *arg)
+{
+    const int number_of_chunks = chunk_count(pool, len);
+
+    if (number_of_chunks <= 1)
+    {
+        chunk(arg, 0, len, 0);
+        return 1;
+    }
+
+    struct chunk_job job = {chunk, arg, len, number_of_chunks};
+    worker_pool_run(pool, chunk_job_run, &job);
+    return number_of_chunks;
+}
+
+struct reduce_arg
 {
     int (*op)(int, int);
-    int *data;
-    int len;
-    int result;
+    reduce_kernel kernel;
+    const int *data;
+    union padded_value *partials;
 };
 
-void *parallel_reduce_inner(void *arg)
+// reduces one chunk into the slot of its thread
+void reduce_chunk(void *arg, size_t begin, size_t end, int tid)
 {
-    struct parallel_reduce_inner_arg *inner_arg = (struct parallel_reduce_inner_arg *)arg;
-    int result = parallel_reduce(inner_arg->op, inner_arg->data, inner_arg->len);
-    inner_arg->result = result;
+    struct reduce_arg *reduce_arg = (struct reduce_arg *)arg;
 
-    return NULL;
+    if (reduce_arg->kernel != NULL)
+        reduce_arg->partials[tid].i32 = reduce_arg->kernel(reduce_arg->data + begin, end - begin);
+    else
+        reduce_arg->partials[tid].i32 = reduce(reduce_arg->op, reduce_arg->data + begin, end - begin);
+}
+
+// Every thread of the pool reduces one contiguous chunk into its slot of the
+// pool's partials, the caller then combines those in order under the lock, so op only has to
+// be associative. sum, max and product run on vectorized kernels, any other op
+// is called through its pointer. data is only read, so the same (read only or
+// mapped) array can be reduced again and again. len must not be 0.
+int parallel_reduce_pool(struct worker_pool *pool,
+                         int (*op)(int, int),
+                         const int *data,
+                         size_t len)
+{
+    union padded_value *partials = worker_pool_lock(pool);
+    struct reduce_arg reduce_arg = {op, find_kernel(op), data, partials};
+    int number_of_chunks = run_chunked(pool, len, reduce_chunk, &reduce_arg);
+
+    int result = partials[0].i32;
+    for (int i = 1; i < number_of_chunks; i++)
+        result = op(result, partials[i].i32);
+    worker_pool_unlock(pool);
+    return result;
 }
 
-// Not Optimal
 int parallel_reduce(int (*op)(int, int),
-                    int *data,
-                    int len)
+                    const int *data,
+                    size_t len)
 {
-    int is_exp_2 = (len & (len - 1)) == 0;
+    return parallel_reduce_pool(worker_pool_default(), op, data, len);
+}
 
-    if (!is_exp_2)
+// Sum of ints in a 64 bit accumulator, so it cannot overflow below 2^32
+// elements. Four accumulators, widened four ints at a time on AVX2.
+int64_t sum_wide_scalar(const int *data, size_t len)
+{
+    int64_t acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
     {
-        int max_exp_2 = find_max_exp_2(len);
-
-        // int result_1 = parallel_reduce(op, data, max_exp_2);
-        // int result_2 = parallel_reduce(op, data + max_exp_2, len - max_exp_2);
+        acc0 += data[i];
+        acc1 += data[i + 1];
+        acc2 += data[i + 2];
+        acc3 += data[i + 3];
+    }
+    for (; i < len; i++)
+        acc0 += data[i];
+    return (acc0 + acc1) + (acc2 + acc3);
+}
 
-        struct parallel_reduce_inner_arg inner_arg_1 = {op, data, max_exp_2, 0};
-        struct parallel_reduce_inner_arg inner_arg_2 = {op, data + max_exp_2, len - max_exp_2, 0};
+// Pairwise summation: blocks of PAIRWISE_BLOCK are summed in eight
+// interleaved lanes, blocks are added up as a balanced tree. The error grows
+// with log(len) instead of len and the lanes still fill the vector units.
+#define PAIRWISE_BLOCK 256
 
-        pthread_t thread_1;
-        pthread_t thread_2;
+#define PAIRWISE_SUM(suffix, type)                                                     \
+    type sum_block_##suffix##_scalar(const type *data, size_t len)                     \
+    {                                                                                  \
+        type lane[8] = {0, 0, 0, 0, 0, 0, 0, 0};                                       \
+        size_t i = 0;                                                                  \
+        for (; i + 8 <= len; i += 8)                                                   \
+            for (int j = 0; j < 8; j++)                                                \
+                lane[j] += data[i + j];                                                \
+        for (; i < len; i++)                                                           \
+            lane[i % 8] += data[i];                                                    \
+        return ((lane[0] + lane[1]) + (lane[2] + lane[3])) +                           \
+               ((lane[4] + lane[5]) + (lane[6] + lane[7]));                            \
+    }
 
-        pthread_create(&thread_1, NULL, parallel_reduce_inner, (void *)(&inner_arg_1));
-        pthread_create(&thread_2, NULL, parallel_reduce_inner, (void *)(&inner_arg_2));
-        pthread_join(thread_1, NULL);
-        pthread_join(thread_2, NULL);
+PAIRWISE_SUM(f32, float)
+PAIRWISE_SUM(f64, double)
 
-        int result_1 = inner_arg_1.result;
-        int result_2 = inner_arg_2.result;
+#if defined(__x86_64__) || defined(__i386__)
 
-        return op(result_1, result_2);
+__attribute__((target("avx2"))) int64_t sum_wide_avx2(const int *data, size_t len)
+{
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = acc0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        acc0 = _mm256_add_epi64(acc0, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
     }
+    int64_t lane[4];
+    memcpy(lane, &acc0, sizeof(lane));
+    int64_t result = (lane[0] + lane[1]) + (lane[2] + lane[3]);
+    memcpy(lane, &acc1, sizeof(lane));
+    result += (lane[0] + lane[1]) + (lane[2] + lane[3]);
+    for (; i < len; i++)
+        result += data[i];
+    return result;
+}
 
-    const int number_of_threads = len / 2;
-    if (number_of_threads == 0)
+// the same eight lanes as sum_block_f32_scalar, in one register
+__attribute__((target("avx2"))) float sum_block_f32_avx2(const float *data, size_t len)
+{
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+        acc = _mm256_add_ps(acc, _mm256_loadu_ps(data + i));
+    float lane[8];
+    _mm256_storeu_ps(lane, acc);
+    for (; i < len; i++)
+        lane[i % 8] += data[i];
+    return ((lane[0] + lane[1]) + (lane[2] + lane[3])) + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+}
+
+// the same eight lanes as sum_block_f64_scalar, in two registers
+__attribute__((target("avx2"))) double sum_block_f64_avx2(const double *data, size_t len)
+{
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = acc0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
     {
-        return data[0];
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(data + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(data + i + 4));
     }
+    double lane[8];
+    _mm256_storeu_pd(lane, acc0);
+    _mm256_storeu_pd(lane + 4, acc1);
+    for (; i < len; i++)
+        lane[i % 8] += data[i];
+    return ((lane[0] + lane[1]) + (lane[2] + lane[3])) + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+}
 
-    // pthread_t threads[number_of_threads];
-    // struct kernel_arg kernel_arg_array[number_of_threads];
+#endif
 
-    pthread_t *threads = malloc(sizeof(pthread_t) * number_of_threads);
-    struct kernel_arg *kernel_arg_array = malloc(sizeof(struct kernel_arg) * number_of_threads);
+// the typed kernels this cpu runs, picked once
+struct typed_kernels
+{
+    int64_t (*sum_wide)(const int *data, size_t len);
+    float (*sum_block_f32)(const float *data, size_t len);
+    double (*sum_block_f64)(const double *data, size_t len);
+};
 
-    pthread_barrier_t barrier;
-    pthread_barrier_init(&barrier, NULL, number_of_threads);
+struct typed_kernels typed_kernels = {sum_wide_scalar, sum_block_f32_scalar, sum_block_f64_scalar};
+pthread_once_t typed_kernels_once = PTHREAD_ONCE_INIT;
 
-    for (int i = 0; i < number_of_threads; i++)
+void typed_kernels_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
     {
-        kernel_arg_array[i].tid = i;
-        kernel_arg_array[i].number_of_threads = number_of_threads;
-        kernel_arg_array[i].op = op;
-        kernel_arg_array[i].data = data;
-        kernel_arg_array[i].len = len;
-        kernel_arg_array[i].barrier = &barrier;
+        typed_kernels.sum_wide = sum_wide_avx2;
+        typed_kernels.sum_block_f32 = sum_block_f32_avx2;
+        typed_kernels.sum_block_f64 = sum_block_f64_avx2;
+    }
+#endif
+}
+
+int64_t sum_wide(const int *data, size_t len)
+{
+    pthread_once(&typed_kernels_once, typed_kernels_init);
+    return typed_kernels.sum_wide(data, len);
+}
+
+float sum_pairwise_f32(const float *data, size_t len)
+{
+    pthread_once(&typed_kernels_once, typed_kernels_init);
+    if (len <= PAIRWISE_BLOCK)
+        return typed_kernels.sum_block_f32(data, len);
+
+    // split on a block boundary, so the blocks do not depend on the depth
+    size_t half = (len / 2 + PAIRWISE_BLOCK - 1) / PAIRWISE_BLOCK * PAIRWISE_BLOCK;
+    return sum_pairwise_f32(data, half) + sum_pairwise_f32(data + half, len - half);
+}
+
+double sum_pairwise_f64(const double *data, size_t len)
+{
+    pthread_once(&typed_kernels_once, typed_kernels_init);
+    if (len <= PAIRWISE_BLOCK)
+        return typed_kernels.sum_block_f64(data, len);
+
+    size_t half = (len / 2 + PAIRWISE_BLOCK - 1) / PAIRWISE_BLOCK * PAIRWISE_BLOCK;
+    return sum_pairwise_f64(data, half) + sum_pairwise_f64(data + half, len - half);
+}
+
+int64_t max_i64(int64_t a, int64_t b)
+{
+    return (a > b) ? a : b;
+}
+
+int64_t sum_i64(int64_t a, int64_t b)
+{
+    return a + b;
+}
+
+int64_t product_i64(int64_t a, int64_t b)
+{
+    return a * b;
+}
+
+float max_f32(float a, float b)
+{
+    return (a > b) ? a : b;
+}
+
+float sum_f32(float a, float b)
+{
+    return a + b;
+}
+
+double max_f64(double a, double b)
+{
+    return (a > b) ? a : b;
+}
+
+double sum_f64(double a, double b)
+{
+    return a + b;
+}
+
+SCALAR_KERNEL(sum_i64, sum_i64, 0, int64_t)
+SCALAR_KERNEL(max_i64, max_i64, INT64_MIN, int64_t)
+SCALAR_KERNEL(product_i64, product_i64, 1, int64_t)
+
+// the kernels behind the built in ops of each type, NULL for other ops
+int64_t (*find_kernel_i64(int64_t (*op)(int64_t, int64_t)))(const int64_t *, size_t)
+{
+    if (op == sum_i64)
+        return sum_i64_scalar;
+    if (op == max_i64)
+        return max_i64_scalar;
+    if (op == product_i64)
+        return product_i64_scalar;
+    return NULL;
+}
+
+float (*find_kernel_f32(float (*op)(float, float)))(const float *, size_t)
+{
+    return op == sum_f32 ? sum_pairwise_f32 : NULL;
+}
+
+double (*find_kernel_f64(double (*op)(double, double)))(const double *, size_t)
+{
+    return op == sum_f64 ? sum_pairwise_f64 : NULL;
+}
+
+// reduce, parallel_reduce and parallel_reduce_pool for one more element type,
+// with the kernel find_kernel_suffix returns in place of op where there is one
+#define TYPED_REDUCE(suffix, type, member)                                                  \
+    type reduce_##suffix(type (*op)(type, type), const type *data, size_t len)              \
+    {                                                                                       \
+        type result = data[0];                                                              \
+        for (size_t i = 1; i < len; ++i)                                                    \
+            result = op(result, data[i]);                                                   \
+        return result;                                                                      \
+    }                                                                                       \
+                                                                                            \
+    struct reduce_##suffix##_arg                                                            \
+    {                                                                                       \
+        type (*op)(type, type);                                                             \
+        type (*kernel)(const type *, size_t);                                               \
+        const type *data;                                                                   \
+        union padded_value *partials;                                                       \
+    };                                                                                      \
+                                                                                            \
+    void reduce_##suffix##_chunk(void *arg, size_t begin, size_t end, int tid)              \
+    {                                                                                       \
+        struct reduce_##suffix##_arg *reduce_arg = (struct reduce_##suffix##_arg *)arg;     \
+        if (reduce_arg->kernel != NULL)                                                     \
+            reduce_arg->partials[tid].member = reduce_arg->kernel(reduce_arg->data + begin, \
+                                                                  end - begin);             \
+        else                                                                                \
+            reduce_arg->partials[tid].member = reduce_##suffix(reduce_arg->op,              \
+                                                               reduce_arg->data + begin,    \
+                                                               end - begin);                \
+    }                                                                                       \
+                                                                                            \
+    type parallel_reduce_##suffix##_pool(struct worker_pool *pool,                          \
+                                         type (*op)(type, type),                            \
+                                         const type *data,                                  \
+                                         size_t len)                                        \
+    {                                                                                       \
+        union padded_value *partials = worker_pool_lock(pool);                              \
+        struct reduce_##suffix##_arg reduce_arg = {op, find_kernel_##suffix(op), data,      \
+                                                   partials};                               \
+        int number_of_chunks = run_chunked(pool, len, reduce_##suffix##_chunk, &reduce_arg); \
+                                                                                            \
+        type result = partials[0].member;                                                   \
+        for (int i = 1; i < number_of_chunks; i++)                                          \
+            result = op(result, partials[i].member);                                        \
+        worker_pool_unlock(pool);                                                           \
+        return result;                                                                      \
+    }                                                                                       \
+                                                                                            \
+    type parallel_reduce_##suffix(type (*op)(type, type), const type *data, size_t len)     \
+    {                                                                                       \
+        return parallel_reduce_##suffix##_pool(worker_pool_default(), op, data, len);       \
+    }
+
+TYPED_REDUCE(i64, int64_t, i64)
+TYPED_REDUCE(f32, float, f32)
+TYPED_REDUCE(f64, double, f64)
+
+void sum_wide_chunk(void *arg, size_t begin, size_t end, int tid)
+{
+    struct reduce_arg *reduce_arg = (struct reduce_arg *)arg;
+    reduce_arg->partials[tid].i64 = sum_wide(reduce_arg->data + begin, end - begin);
+}
+
+// the sum of ints as int64, which does not wrap around like parallel_reduce(sum, ...)
+int64_t parallel_sum_wide_pool(struct worker_pool *pool, const int *data, size_t len)
+{
+    union padded_value *partials = worker_pool_lock(pool);
+    struct reduce_arg reduce_arg = {sum, NULL, data, partials};
+    int number_of_chunks = run_chunked(pool, len, sum_wide_chunk, &reduce_arg);
 
-        pthread_create(&threads[i], NULL, kernel, (void *)(kernel_arg_array + i));
+    int64_t result = 0;
+    for (int i = 0; i < number_of_chunks; i++)
+        result += partials[i].i64;
+    worker_pool_unlock(pool);
+    return result;
+}
+
+int64_t parallel_sum_wide(const int *data, size_t len)
+{
+    return parallel_sum_wide_pool(worker_pool_default(), data, len);
+}
+
+// out[i] = data[0] op ... op data[i] for i < len. A chain that calls one of
+// the ops directly instead of through op, where it is one, so it is inlined.
+#define SCAN_LOOP(combine)                \
+    for (size_t i = 0; i < len; i++)      \
+    {                                     \
+        acc = combine(acc, data[i]);      \
+        out[i] = acc;                     \
+    }
+
+// Sequential and parallel inclusive and exclusive scans for one element type.
+// The parallel ones take two passes over chunks of the pool: every chunk is
+// reduced, the caller scans the chunk totals into the prefix of each chunk,
+// then every chunk is scanned again starting from its prefix. out may be
+// data, which scans in place. op only has to be associative.
+#define TYPED_SCAN(suffix, type, member, reduce_fn, find_kernel_fn, sum_op, max_op)               \
+    /* out[i] = acc op data[0] op ... op data[i] */                                              \
+    void scan_from##suffix(type (*op)(type, type), const type *data, type *out, size_t len,      \
+                           type acc)                                                              \
+    {                                                                                             \
+        if (op == sum_op)                                                                         \
+            SCAN_LOOP(sum_op)                                                                     \
+        else if (op == max_op)                                                                    \
+            SCAN_LOOP(max_op)                                                                     \
+        else                                                                                      \
+            SCAN_LOOP(op)                                                                         \
+    }                                                                                             \
+                                                                                                  \
+    /* out[i] = data[0] op ... op data[i] */                                                     \
+    void inclusive_scan##suffix(type (*op)(type, type), const type *data, type *out, size_t len) \
+    {                                                                                             \
+        if (len == 0)                                                                             \
+            return;                                                                               \
+        out[0] = data[0];                                                                         \
+        scan_from##suffix(op, data + 1, out + 1, len - 1, data[0]);                               \
+    }                                                                                             \
+                                                                                                  \
+    /* out[i] = init op data[0] op ... op data[i - 1], out[0] = init */                          \
+    void exclusive_scan##suffix(type (*op)(type, type), const type *data, type *out, size_t len, \
+                                type init)                                                        \
+    {                                                                                             \
+        type acc = init;                                                                          \
+        for (size_t i = 0; i < len; i++)                                                          \
+        {                                                                                         \
+            type next = op(acc, data[i]);                                                         \
+            out[i] = acc;                                                                         \
+            acc = next;                                                                           \
+        }                                                                                         \
+    }                                                                                             \
+                                                                                                  \
+    struct scan##suffix##_arg                                                                     \
+    {                                                                                             \
+        type (*op)(type, type);                                                                   \
+        type (*kernel)(const type *, size_t);                                                     \
+        const type *data;                                                                         \
+        type *out;                                                                                \
+        union padded_value *partials;                                                             \
+        int inclusive;                                                                            \
+    };                                                                                            \
+                                                                                                  \
+    void scan##suffix##_reduce_chunk(void *arg, size_t begin, size_t end, int tid)                \
+    {                                                                                             \
+        struct scan##suffix##_arg *scan_arg = (struct scan##suffix##_arg *)arg;                   \
+        if (scan_arg->kernel != NULL)                                                             \
+            scan_arg->partials[tid].member = scan_arg->kernel(scan_arg->data + begin, end - begin); \
+        else                                                                                      \
+            scan_arg->partials[tid].member = reduce_fn(scan_arg->op, scan_arg->data + begin,      \
+                                                       end - begin);                              \
+    }                                                                                             \
+                                                                                                  \
+    /* partials hold the prefix of every chunk by now */                                          \
+    void scan##suffix##_rescan_chunk(void *arg, size_t begin, size_t end, int tid)                \
+    {                                                                                             \
+        struct scan##suffix##_arg *scan_arg = (struct scan##suffix##_arg *)arg;                   \
+        const type *data = scan_arg->data + begin;                                                \
+        type *out = scan_arg->out + begin;                                                        \
+        if (!scan_arg->inclusive)                                                                 \
+            exclusive_scan##suffix(scan_arg->op, data, out, end - begin,                          \
+                                   scan_arg->partials[tid].member);                               \
+        else if (tid == 0)                                                                        \
+            inclusive_scan##suffix(scan_arg->op, data, out, end - begin);                         \
+        else                                                                                      \
+            scan_from##suffix(scan_arg->op, data, out, end - begin,                               \
+                              scan_arg->partials[tid].member);                                    \
+    }                                                                                             \
+                                                                                                  \
+    void parallel_scan##suffix##_pool(struct worker_pool *pool, type (*op)(type, type),           \
+                                      const type *data, type *out, size_t len,                   \
+                                      int inclusive, type init)                                   \
+    {                                                                                             \
+        const int number_of_chunks = chunk_count(pool, len);                                      \
+        if (number_of_chunks <= 1)                                                                \
+        {                                                                                         \
+            if (inclusive)                                                                        \
+                inclusive_scan##suffix(op, data, out, len);                                       \
+            else                                                                                  \
+                exclusive_scan##suffix(op, data, out, len, init);                                 \
+            return;                                                                               \
+        }                                                                                         \
+                                                                                                  \
+        union padded_value *partials = worker_pool_lock(pool);                                    \
+        struct scan##suffix##_arg scan_arg = {op, find_kernel_fn(op), data, out,                  \
+                                              partials, inclusive};                               \
+        run_chunked(pool, len, scan##suffix##_reduce_chunk, &scan_arg);                           \
+                                                                                                  \
+        /* the first chunk of an inclusive scan has no prefix */                                  \
+        int first = inclusive ? 1 : 0;                                                            \
+        type acc = inclusive ? partials[0].member : init;                                         \
+        for (int i = first; i < number_of_chunks; i++)                                            \
+        {                                                                                         \
+            type total = partials[i].member;                                                      \
+            partials[i].member = acc;                                                             \
+            acc = op(acc, total);                                                                 \
+        }                                                                                         \
+                                                                                                  \
+        run_chunked(pool, len, scan##suffix##_rescan_chunk, &scan_arg);                           \
+        worker_pool_unlock(pool);                                                                 \
+    }                                                                                             \
+                                                                                                  \
+    void parallel_inclusive_scan##suffix##_pool(struct worker_pool *pool,                         \
+                                                type (*op)(type, type),                           \
+                                                const type *data, type *out, size_t len)          \
+    {                                                                                             \
+        parallel_scan##suffix##_pool(pool, op, data, out, len, 1, (type)0);                       \
+    }                                                                                             \
+                                                                                                  \
+    void parallel_inclusive_scan##suffix(type (*op)(type, type), const type *data, type *out,    \
+                                         size_t len)                                              \
+    {                                                                                             \
+        parallel_scan##suffix##_pool(worker_pool_default(), op, data, out, len, 1, (type)0);      \
+    }                                                                                             \
+                                                                                                  \
+    void parallel_exclusive_scan##suffix##_pool(struct worker_pool *pool,                         \
+                                                type (*op)(type, type),                           \
+                                                const type *data, type *out, size_t len,          \
+                                                type init)                                        \
+    {                                                                                             \
+        parallel_scan##suffix##_pool(pool, op, data, out, len, 0, init);                          \
+    }                                                                                             \
+                                                                                                  \
+    void parallel_exclusive_scan##suffix(type (*op)(type, type), const type *data, type *out,    \
+                                         size_t len, type init)                                   \
+    {                                                                                             \
+        parallel_scan##suffix##_pool(worker_pool_default(), op, data, out, len, 0, init);         \
     }
 
-    for (int i = 0; i < number_of_threads; i++)
+TYPED_SCAN(, int, i32, reduce, find_kernel, sum, max)
+TYPED_SCAN(_i64, int64_t, i64, reduce_i64, find_kernel_i64, sum_i64, max_i64)
+TYPED_SCAN(_f32, float, f32, reduce_f32, find_kernel_f32, sum_f32, max_f32)
+TYPED_SCAN(_f64, double, f64, reduce_f64, find_kernel_f64, sum_f64, max_f64)
+
+struct reduce_generic_arg
+{
+    void (*op)(void *result, const void *a, const void *b);
+    const char *data;
+    size_t elem_size;
+    char *partials;
+    size_t stride;
+};
+
+void reduce_generic_chunk(void *arg, size_t begin, size_t end, int tid)
+{
+    struct reduce_generic_arg *reduce_arg = (struct reduce_generic_arg *)arg;
+    char *partial = reduce_arg->partials + tid * reduce_arg->stride;
+
+    memcpy(partial, reduce_arg->data + begin * reduce_arg->elem_size, reduce_arg->elem_size);
+    for (size_t i = begin + 1; i < end; i++)
+        reduce_arg->op(partial, partial, reduce_arg->data + i * reduce_arg->elem_size);
+}
+
+// Reduces len elements of elem_size bytes, for structs and other types with
+// an associative op. op(result, a, b) stores a op b in result, result may be
+// a. The outcome is written to result, len must not be 0.
+void parallel_reduce_generic_pool(struct worker_pool *pool,
+                                  void (*op)(void *result, const void *a, const void *b),
+                                  const void *data,
+                                  size_t len,
+                                  size_t elem_size,
+                                  void *result)
+{
+    // a slot of whole cache lines per thread
+    const size_t stride = (elem_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    char *partials;
+    if (posix_memalign((void **)&partials, CACHE_LINE, stride * pool->number_of_threads) != 0)
     {
-        pthread_join(threads[i], NULL);
+        exit(-1);
     }
 
-    pthread_barrier_destroy(&barrier);
+    struct reduce_generic_arg reduce_arg = {op, (const char *)data, elem_size, partials, stride};
+    worker_pool_lock(pool);
+    int number_of_chunks = run_chunked(pool, len, reduce_generic_chunk, &reduce_arg);
+    worker_pool_unlock(pool);
 
-    free(kernel_arg_array);
-    free(threads);
+    memcpy(result, partials, elem_size);
+    for (int i = 1; i < number_of_chunks; i++)
+        op(result, result, partials + i * stride);
 
-    return data[0];
+    free(partials);
 }
 
-int main()
+void parallel_reduce_generic(void (*op)(void *result, const void *a, const void *b),
+                             const void *data,
+                             size_t len,
+                             size_t elem_size,
+                             void *result)
 {
-    // Since our reduce function updates in place, we need to copy the data
-    int data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
-    int len = 10;
+    parallel_reduce_generic_pool(worker_pool_default(), op, data, len, elem_size, result);
+}
 
-    int data_2[len];
-    int data_3[len];
-    for (int i = 0; i < len; i++)
+// 2x2 matrices mod 1000000007, an associative but not commutative op
+struct matrix
+{
+    int64_t m[2][2];
+};
+
+void matrix_product(void *result, const void *a, const void *b)
+{
+    const struct matrix *x = (const struct matrix *)a;
+    const struct matrix *y = (const struct matrix *)b;
+    struct matrix product;
+
+    for (int i = 0; i < 2; i++)
+        for (int j = 0; j < 2; j++)
+            product.m[i][j] = (x->m[i][0] * y->m[0][j] + x->m[i][1] * y->m[1][j]) % 1000000007;
+
+    memcpy(result, &product, sizeof(product));
+}
+
+double seconds_since(const struct timespec *begin)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) + (now.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+// ./main [len]: without len the demo, with len a timed sum over len ints
+int main(int argc, char **argv)
+{
+    if (argc > 1)
     {
-        data_2[i] = data[i];
-        data_3[i] = data[i];
+        size_t len = strtoull(argv[1], NULL, 10);
+        // alternating 0 and 1, so no sum or prefix overflows an int
+        if (len == 0 || len / 2 > INT_MAX)
+        {
+            fprintf(stderr, "usage: ./main [len], 0 < len < 2^32\n");
+            exit(-1);
+        }
+        int *big = malloc(sizeof(int) * len);
+        if (big == NULL)
+        {
+            exit(-1);
+        }
+        for (size_t i = 0; i < len; i++)
+            big[i] = (int)(i & 1);
+
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        int seq_sum = reduce(sum, big, len);
+        double seq_seconds = seconds_since(&begin);
+
+        worker_pool_default();
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        int par_sum = parallel_reduce(sum, big, len);
+        double par_seconds = seconds_since(&begin);
+
+        printf("seq sum: %i in %.3f s (%.2f GB/s); par sum: %i in %.3f s (%.2f GB/s) on %i threads\n",
+               seq_sum, seq_seconds, len * sizeof(int) / seq_seconds / 1e9,
+               par_sum, par_seconds, len * sizeof(int) / par_seconds / 1e9,
+               worker_pool_default()->number_of_threads);
+
+        // in place, the last prefix is the sum
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        parallel_inclusive_scan(sum, big, big, len);
+        double scan_seconds = seconds_since(&begin);
+
+        printf("par scan: last %i in %.3f s (%.2f GB/s)\n",
+               big[len - 1], scan_seconds, len * sizeof(int) / scan_seconds / 1e9);
+
+        free(big);
+        return 0;
     }
 
+    const int data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    int len = 10;
+
     int seq_sum = reduce(sum, data, len);
 
     int par_sum = parallel_reduce(sum, data, len);
 
     printf("seq sum: %i; par sum: %i\n", seq_sum, par_sum);
 
-    int seq_max = reduce(max, data_2, len);
-    int par_max = parallel_reduce(max, data_2, len);
+    int seq_max = reduce(max, data, len);
+    int par_max = parallel_reduce(max, data, len);
 
     printf("seq max: %i; par max: %i\n", seq_max, par_max);
 
-    int seq_product = reduce(product, data_3, len);
-    int par_product = parallel_reduce(product, data_3, len);
+    int seq_product = reduce(product, data, len);
+    int par_product = parallel_reduce(product, data, len);
 
     printf("seq product: %i; par product: %i\n", seq_product, par_product);
 
+    int prefix[10];
+    parallel_inclusive_scan(sum, data, prefix, len);
+    printf("inclusive sum scan:");
+    for (int i = 0; i < len; i++)
+        printf(" %i", prefix[i]);
+    parallel_exclusive_scan(max, data, prefix, len, INT_MIN);
+    printf("\nexclusive max scan:");
+    for (int i = 0; i < len; i++)
+        printf(" %i", prefix[i]);
+    printf("\n");
+
+    // 2^16 * 2^16 does not fit an int, parallel_reduce(sum, ...) would overflow
+    const size_t wide_len = 1 << 16;
+    int *wide = malloc(sizeof(int) * wide_len);
+    float *tenths = malloc(sizeof(float) * 10000000);
+    struct matrix *fibonacci = malloc(sizeof(struct matrix) * 90);
+    if (wide == NULL || tenths == NULL || fibonacci == NULL)
+    {
+        exit(-1);
+    }
+
+    for (size_t i = 0; i < wide_len; i++)
+        wide[i] = 1 << 16;
+    printf("wide sum: %lld; expected: %lld\n", (long long)parallel_sum_wide(wide, wide_len), (long long)wide_len << 16);
+
+    for (size_t i = 0; i < 10000000; i++)
+        tenths[i] = 0.1f;
+    printf("seq float sum: %f; pairwise float sum: %f\n",
+           reduce_f32(sum_f32, tenths, 10000000), parallel_reduce_f32(sum_f32, tenths, 10000000));
+
+    // the 90th power of {{1, 1}, {1, 0}} holds fib(90) mod 1000000007
+    for (int i = 0; i < 90; i++)
+    {
+        struct matrix m = {{{1, 1}, {1, 0}}};
+        fibonacci[i] = m;
+    }
+    struct matrix power;
+    parallel_reduce_generic(matrix_product, fibonacci, 90, sizeof(struct matrix), &power);
+    printf("fib(90) mod 1000000007: %lld\n", (long long)power.m[0][1]);
+
+    free(fibonacci);
+    free(tenths);
+    free(wide);
+
     return 0;
 }
 